@@ -0,0 +1,84 @@
+/* This file is part of GEGL
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Allocation counting of png-bench and png-stress.  The counting versions
+ * of the allocator hand on to glibc's own.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "png-bench.h"
+
+#if BENCH_COUNTS_ALLOCATIONS
+extern void *__libc_malloc   (size_t size);
+extern void *__libc_calloc   (size_t n, size_t size);
+extern void *__libc_realloc  (void *ptr, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+
+static guint64 n_allocations;
+
+static inline void
+count_allocation (void)
+{
+  __atomic_fetch_add (&n_allocations, 1, __ATOMIC_RELAXED);
+}
+
+void *
+malloc (size_t size)
+{
+  count_allocation ();
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n,
+        size_t size)
+{
+  count_allocation ();
+  return __libc_calloc (n, size);
+}
+
+void *
+realloc (void   *ptr,
+         size_t  size)
+{
+  count_allocation ();
+  return __libc_realloc (ptr, size);
+}
+
+int
+posix_memalign (void   **ptr,
+                size_t   alignment,
+                size_t   size)
+{
+  count_allocation ();
+  *ptr = __libc_memalign (alignment, size);
+  return *ptr ? 0 : ENOMEM;
+}
+
+guint64
+allocations (void)
+{
+  return __atomic_load_n (&n_allocations, __ATOMIC_RELAXED);
+}
+#else
+guint64
+allocations (void)
+{
+  return 0;
+}
+#endif
@@ -0,0 +1,441 @@
+/* This file is part of GEGL
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark of gegl:png-load and gegl:png-save.
+ *
+ * Every png given on the command line, or found below a directory given
+ * there, is measured through the public API the way applications use the
+ * ops:
+ *
+ *   query  the bounding box of a fresh gegl:png-load node, which is
+ *          query_png ()
+ *   load   processing the node into a buffer, gegl_buffer_import_png (),
+ *          once verifying the checksums and once trusted to skip them
+ *   save   gegl:png-save of the loaded image at every compression level
+ *          and bit depth, export_png (); the file written is then queried
+ *          and loaded in turn
+ *
+ * Each measurement is repeated and the fastest run kept.  The results are
+ * printed as a JSON array with one object per measurement, holding the
+ * pixel data in MB/s, the rows per second, the peak resident set during
+ * the run in kilobytes and the number of allocations made, so that runs
+ * before and after a change can be compared by script.  The peak is only
+ * reset between runs on Linux, and allocations are only counted with
+ * glibc; they are null otherwise.
+ *
+ * Build it against an installed GEGL, with the png ops on GEGL_PATH:
+ *
+ *   cc -O2 png-bench.c png-bench-alloc.c -o png-bench \
+ *      $(pkg-config --cflags --libs gegl-0.4)
+ *   ./png-bench [-r REPEATS] [-j THREADS] [-l LEVELS] FILE|DIR... > out.json
+ *
+ * LEVELS is a comma separated list of compression levels, all of 1 to 9
+ * by default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <gegl.h>
+
+#include "png-bench.h"
+
+#define BENCH_MAX_LEVELS 9
+
+typedef struct
+{
+  const gchar   *name;        /* of the input, for the results */
+  const gchar   *path;        /* of the file measured */
+  gint           compression; /* it was written with, -1 for inputs */
+  gint           bitdepth;    /* written with, 0 for inputs */
+  gboolean       trusted;     /* loads skip verifying the checksums */
+  GeglBuffer    *buffer;      /* the image as last loaded */
+  GeglRectangle  extent;
+  const gchar   *target;      /* of saves */
+  gint           save_compression;
+  gint           save_bitdepth;
+} BenchCase;
+
+typedef gboolean (* BenchFunc) (BenchCase *bench);
+
+typedef struct
+{
+  gint64  time;             /* in microseconds, of the fastest run */
+  guint64 peak_rss;
+  guint64 allocations;
+} BenchResult;
+
+static gboolean
+bench_query (BenchCase *bench)
+{
+  GeglNode *graph = gegl_node_new ();
+  GeglNode *load  = gegl_node_new_child (graph,
+                                         "operation", "gegl:png-load",
+                                         "path",      bench->path,
+                                         NULL);
+
+  bench->extent = gegl_node_get_bounding_box (load);
+  g_object_unref (graph);
+
+  return ! gegl_rectangle_is_empty (&bench->extent);
+}
+
+static gboolean
+bench_load (BenchCase *bench)
+{
+  GeglNode   *graph  = gegl_node_new ();
+  GeglBuffer *buffer = NULL;
+  GeglNode   *load;
+  GeglNode   *sink;
+
+  load = gegl_node_new_child (graph,
+                              "operation", "gegl:png-load",
+                              "path",      bench->path,
+                              "trusted",   bench->trusted,
+                              NULL);
+  sink = gegl_node_new_child (graph,
+                              "operation", "gegl:buffer-sink",
+                              "buffer",    &buffer,
+                              NULL);
+  gegl_node_link (load, sink);
+  gegl_node_process (sink);
+  g_object_unref (graph);
+
+  g_clear_object (&bench->buffer);
+  bench->buffer = buffer;
+  if (buffer)
+    bench->extent = *gegl_buffer_get_extent (buffer);
+
+  return buffer && ! gegl_rectangle_is_empty (&bench->extent);
+}
+
+static gboolean
+bench_save (BenchCase *bench)
+{
+  GeglNode *graph = gegl_node_new ();
+  GeglNode *source;
+  GeglNode *save;
+
+  g_unlink (bench->target);
+  source = gegl_node_new_child (graph,
+                                "operation",   "gegl:buffer-source",
+                                "buffer",      bench->buffer,
+                                NULL);
+  save   = gegl_node_new_child (graph,
+                                "operation",   "gegl:png-save",
+                                "path",        bench->target,
+                                "compression", bench->save_compression,
+                                "bitdepth",    bench->save_bitdepth,
+                                NULL);
+  gegl_node_link (source, save);
+  gegl_node_process (save);
+  g_object_unref (graph);
+
+  return g_file_test (bench->target, G_FILE_TEST_EXISTS);
+}
+
+/* runs @func @repeats times, keeping the fastest time, the highest peak
+ * and the allocations of the first run
+ */
+static gboolean
+bench_run (BenchFunc    func,
+           BenchCase   *bench,
+           gint         repeats,
+           BenchResult *result)
+{
+  gint i;
+
+  memset (result, 0, sizeof (BenchResult));
+
+  for (i = 0; i < repeats; i++)
+    {
+      guint64 before;
+      gint64  start;
+      gint64  time;
+
+      peak_rss_reset ();
+      before = allocations ();
+      start  = g_get_monotonic_time ();
+
+      if (! func (bench))
+        return FALSE;
+
+      time = g_get_monotonic_time () - start;
+      if (i == 0 || time < result->time)
+        result->time = time;
+      if (i == 0)
+        result->allocations = allocations () - before;
+      result->peak_rss = MAX (result->peak_rss, peak_rss ());
+    }
+
+  return TRUE;
+}
+
+static void
+json_int_or_null (GString *json,
+                  gint64   value,
+                  gboolean valid)
+{
+  if (valid)
+    g_string_append_printf (json, "%" G_GINT64_FORMAT, value);
+  else
+    g_string_append (json, "null");
+}
+
+static void
+json_rate_or_null (GString *json,
+                   gdouble  value,
+                   gboolean valid)
+{
+  if (valid)
+    g_string_append_printf (json, "%.2f", value);
+  else
+    g_string_append (json, "null");
+}
+
+static gboolean first_result = TRUE;
+
+/* prints one measurement of @op, over @file_bytes of png and @pixel_bytes
+ * of pixel data; queries have no rates
+ */
+static void
+bench_print (const BenchCase   *bench,
+             const gchar       *op,
+             gint               compression,
+             gint               bitdepth,
+             gint64             file_bytes,
+             guint64            pixel_bytes,
+             const BenchResult *result)
+{
+  GString *json    = g_string_new (first_result ? "  " : ",\n  ");
+  gdouble  seconds = MAX (result->time, 1) / (gdouble) G_USEC_PER_SEC;
+
+  g_string_append (json, "{\"file\":");
+  json_string (json, bench->name);
+  g_string_append_printf (json, ",\"op\":\"%s\",\"compression\":", op);
+  json_int_or_null (json, compression, compression >= 0);
+  g_string_append (json, ",\"bitdepth\":");
+  json_int_or_null (json, bitdepth, bitdepth > 0);
+  g_string_append_printf (json, ",\"trusted\":%s",
+                          bench->trusted ? "true" : "false");
+  g_string_append_printf (json,
+                          ",\"width\":%d,\"height\":%d"
+                          ",\"file_bytes\":%" G_GINT64_FORMAT
+                          ",\"pixel_bytes\":%" G_GUINT64_FORMAT
+                          ",\"seconds\":%.6f,\"mb_per_s\":",
+                          bench->extent.width, bench->extent.height,
+                          file_bytes, pixel_bytes, seconds);
+  json_rate_or_null (json, pixel_bytes / seconds / (1024.0 * 1024.0),
+                     pixel_bytes > 0);
+  g_string_append (json, ",\"rows_per_s\":");
+  json_rate_or_null (json, bench->extent.height / seconds, pixel_bytes > 0);
+  g_string_append_printf (json,
+                          ",\"peak_rss_kb\":%" G_GUINT64_FORMAT
+                          ",\"allocations\":",
+                          result->peak_rss);
+  json_int_or_null (json, result->allocations, BENCH_COUNTS_ALLOCATIONS);
+  g_string_append_c (json, '}');
+
+  fputs (json->str, stdout);
+  fflush (stdout);
+  g_string_free (json, TRUE);
+  first_result = FALSE;
+}
+
+/* queries and loads @bench->path, verified and trusted, leaving the image
+ * in @bench->buffer
+ */
+static gboolean
+bench_decode (BenchCase *bench,
+              gint       repeats)
+{
+  BenchResult result;
+  guint64     pixel_bytes;
+  gint        trusted;
+
+  bench->trusted = FALSE;
+  if (! bench_run (bench_query, bench, repeats, &result))
+    return FALSE;
+  bench_print (bench, "query", bench->compression, bench->bitdepth,
+               file_size (bench->path), 0, &result);
+
+  for (trusted = 0; trusted < 2; trusted++)
+    {
+      bench->trusted = trusted;
+      if (! bench_run (bench_load, bench, repeats, &result))
+        return FALSE;
+      pixel_bytes = (guint64) bench->extent.width * bench->extent.height *
+                    babl_format_get_bytes_per_pixel (
+                      gegl_buffer_get_format (bench->buffer));
+      bench_print (bench, "load", bench->compression, bench->bitdepth,
+                   file_size (bench->path), pixel_bytes, &result);
+    }
+  bench->trusted = FALSE;
+
+  return TRUE;
+}
+
+static void
+bench_file (const gchar *path,
+            const gint  *levels,
+            gint         n_levels,
+            const gchar *target,
+            gint         repeats)
+{
+  static const gint bitdepths[] = { 8, 16 };
+  BenchCase   bench = { 0, };
+  GeglBuffer *image;
+  guint       d;
+  gint        i;
+
+  bench.name        = path;
+  bench.path        = path;
+  bench.compression = -1;
+  bench.target      = target;
+
+  if (! bench_decode (&bench, repeats))
+    {
+      g_printerr ("png-bench: could not load %s\n", path);
+      g_clear_object (&bench.buffer);
+      return;
+    }
+  image = g_steal_pointer (&bench.buffer);
+
+  for (d = 0; d < G_N_ELEMENTS (bitdepths); d++)
+    for (i = 0; i < n_levels; i++)
+      {
+        BenchCase   saved = { 0, };
+        BenchResult result;
+        guint64     pixel_bytes;
+
+        bench.buffer           = image;
+        bench.save_compression = levels[i];
+        bench.save_bitdepth    = bitdepths[d];
+
+        if (! bench_run (bench_save, &bench, repeats, &result))
+          {
+            g_printerr ("png-bench: could not save %s\n", path);
+            continue;
+          }
+        pixel_bytes = (guint64) bench.extent.width * bench.extent.height *
+                      babl_format_get_n_components (
+                        gegl_buffer_get_format (image)) *
+                      (bitdepths[d] / 8);
+        bench_print (&bench, "save", levels[i], bitdepths[d],
+                     file_size (target), pixel_bytes, &result);
+
+        /* the file just written, at this level and depth */
+        saved.name        = path;
+        saved.path        = target;
+        saved.compression = levels[i];
+        saved.bitdepth    = bitdepths[d];
+        if (! bench_decode (&saved, repeats))
+          g_printerr ("png-bench: could not load %s saved at %d and %d bits\n",
+                      path, levels[i], bitdepths[d]);
+        g_clear_object (&saved.buffer);
+      }
+
+  bench.buffer = NULL;
+  g_object_unref (image);
+}
+
+static gint
+parse_levels (const gchar *list,
+              gint        *levels)
+{
+  gchar **names = g_strsplit (list, ",", -1);
+  gint    n     = 0;
+  gint    i;
+
+  for (i = 0; names[i] && n < BENCH_MAX_LEVELS; i++)
+    {
+      gint level = atoi (names[i]);
+
+      if (level >= 1 && level <= 9)
+        levels[n++] = level;
+    }
+  g_strfreev (names);
+
+  return n;
+}
+
+static void
+usage (void)
+{
+  g_printerr ("usage: png-bench [-r REPEATS] [-j THREADS] [-l LEVELS] "
+              "FILE|DIR...\n");
+  exit (2);
+}
+
+gint
+main (gint    argc,
+      gchar **argv)
+{
+  GPtrArray *files   = g_ptr_array_new_with_free_func (g_free);
+  gint       levels[BENCH_MAX_LEVELS] = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+  gint       n_levels = BENCH_MAX_LEVELS;
+  gint       repeats  = 3;
+  gint       threads  = 0;
+  gchar     *target;
+  gint       fd;
+  guint      f;
+  gint       i;
+
+  gegl_init (&argc, &argv);
+
+  for (i = 1; i < argc; i++)
+    {
+      if (! strcmp (argv[i], "-r") && i + 1 < argc)
+        repeats = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "-j") && i + 1 < argc)
+        threads = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "-l") && i + 1 < argc)
+        n_levels = parse_levels (argv[++i], levels);
+      else if (argv[i][0] == '-')
+        usage ();
+      else
+        collect_files (files, argv[i]);
+    }
+  if (! files->len || ! n_levels || repeats < 1)
+    usage ();
+  g_ptr_array_sort (files, compare_paths);
+
+  if (threads > 0)
+    g_object_set (gegl_config (), "threads", threads, NULL);
+
+  fd = g_file_open_tmp ("png-bench-XXXXXX.png", &target, NULL);
+  if (fd < 0)
+    {
+      g_printerr ("png-bench: could not create a temporary file\n");
+      return 1;
+    }
+  g_close (fd, NULL);
+
+  fputs ("[\n", stdout);
+  for (f = 0; f < files->len; f++)
+    bench_file (g_ptr_array_index (files, f), levels, n_levels, target,
+                repeats);
+  fputs ("\n]\n", stdout);
+
+  g_unlink (target);
+  g_free (target);
+  g_ptr_array_unref (files);
+  gegl_exit ();
+
+  return 0;
+}
@@ -0,0 +1,167 @@
+/* This file is part of GEGL
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Measurements shared by png-bench and png-stress. */
+
+#ifndef __GEGL_PNG_BENCH_H__
+#define __GEGL_PNG_BENCH_H__
+
+#include <stdio.h>
+#include <string.h>
+#ifndef __linux__
+#include <sys/resource.h>
+#endif
+
+#include <glib/gstdio.h>
+
+/* Allocations, counted by png-bench-alloc.c, which both programs are
+ * built with.  With glibc the allocator can be interposed from the
+ * executable, which every library loaded, the op modules included, then
+ * calls into.
+ */
+#if defined (__GLIBC__) && ! defined (__SANITIZE_ADDRESS__)
+#define BENCH_COUNTS_ALLOCATIONS 1
+#else
+#define BENCH_COUNTS_ALLOCATIONS 0
+#endif
+
+/* the allocations made so far, 0 without BENCH_COUNTS_ALLOCATIONS */
+guint64 allocations (void);
+
+#ifdef __linux__
+/* @field of /proc/self/status, in kilobytes */
+static inline guint64
+status_kb (const gchar *field)
+{
+  FILE    *status = fopen ("/proc/self/status", "r");
+  gsize    length = strlen (field);
+  gchar    line[256];
+  guint64  value  = 0;
+
+  if (! status)
+    return 0;
+  while (fgets (line, sizeof (line), status))
+    if (! strncmp (line, field, length) && line[length] == ':')
+      value = g_ascii_strtoull (line + length + 1, NULL, 10);
+  fclose (status);
+
+  return value;
+}
+#endif
+
+/* the resident set, in kilobytes, 0 where it is not known */
+static inline guint64
+rss (void)
+{
+#ifdef __linux__
+  return status_kb ("VmRSS");
+#else
+  return 0;
+#endif
+}
+
+/* the highest resident set since the last reset, in kilobytes */
+static inline guint64
+peak_rss (void)
+{
+#ifdef __linux__
+  return status_kb ("VmHWM");
+#else
+  struct rusage usage;
+
+  /* not reset between runs, kilobytes on most systems */
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+#endif
+}
+
+/* resets the peak to the resident set as it is now */
+static inline void
+peak_rss_reset (void)
+{
+#ifdef __linux__
+  FILE *clear_refs = fopen ("/proc/self/clear_refs", "w");
+
+  if (clear_refs)
+    {
+      fputs ("5", clear_refs);
+      fclose (clear_refs);
+    }
+#endif
+}
+
+static inline void
+json_string (GString     *json,
+             const gchar *string)
+{
+  g_string_append_c (json, '"');
+  for (; *string; string++)
+    {
+      if (*string == '"' || *string == '\\')
+        g_string_append_printf (json, "\\%c", *string);
+      else if ((guchar) *string < 0x20)
+        g_string_append_printf (json, "\\u%04x", (guchar) *string);
+      else
+        g_string_append_c (json, *string);
+    }
+  g_string_append_c (json, '"');
+}
+
+static inline gint64
+file_size (const gchar *path)
+{
+  GStatBuf st;
+
+  return g_stat (path, &st) ? 0 : st.st_size;
+}
+
+/* adds @path, or the pngs below it if it is a directory, to @files */
+static inline void
+collect_files (GPtrArray   *files,
+               const gchar *path)
+{
+  GDir        *dir;
+  const gchar *name;
+
+  if (! g_file_test (path, G_FILE_TEST_IS_DIR))
+    {
+      g_ptr_array_add (files, g_strdup (path));
+      return;
+    }
+
+  dir = g_dir_open (path, 0, NULL);
+  if (! dir)
+    return;
+  while ((name = g_dir_read_name (dir)))
+    {
+      gchar *child = g_build_filename (path, name, NULL);
+
+      if (g_file_test (child, G_FILE_TEST_IS_DIR) ||
+          g_str_has_suffix (name, ".png"))
+        collect_files (files, child);
+      g_free (child);
+    }
+  g_dir_close (dir);
+}
+
+static inline gint
+compare_paths (gconstpointer a,
+               gconstpointer b)
+{
+  return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+#endif /* __GEGL_PNG_BENCH_H__ */
@@ -0,0 +1,205 @@
+/* This file is part of GEGL
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Shared by png-load.c and png-save.c */
+
+#ifndef __GEGL_PNG_COMMON_H__
+#define __GEGL_PNG_COMMON_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <gegl-plugin.h>
+#include <png.h>
+
+#define PNG_BANDS_CHUNK "gePB"
+
+/* fcTL of animated pngs */
+#define APNG_DISPOSE_OP_NONE       0
+#define APNG_DISPOSE_OP_BACKGROUND 1
+#define APNG_DISPOSE_OP_PREVIOUS   2
+
+#define APNG_BLEND_OP_SOURCE       0
+#define APNG_BLEND_OP_OVER         1
+
+static inline guint32
+png_get_u32 (const guchar *data)
+{
+  return ((guint32) data[0] << 24) | ((guint32) data[1] << 16) |
+         ((guint32) data[2] << 8)  |  (guint32) data[3];
+}
+
+static inline void
+png_put_u32 (guchar  *data,
+             guint32  value)
+{
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+}
+
+/* swaps the bytes of the 16 bit samples in @data, a word at a time */
+static inline void
+swap_bytes_16 (guchar *data,
+               gsize   length)
+{
+  const guint64 mask = G_GUINT64_CONSTANT (0x00ff00ff00ff00ff);
+  gsize         i;
+
+  for (i = 0; i + 8 <= length; i += 8)
+    {
+      guint64 v;
+
+      memcpy (&v, data + i, 8);
+      v = ((v & mask) << 8) | ((v >> 8) & mask);
+      memcpy (data + i, &v, 8);
+    }
+
+  for (; i + 1 < length; i += 2)
+    {
+      guchar t    = data[i];
+      data[i]     = data[i + 1];
+      data[i + 1] = t;
+    }
+}
+
+/* Instrumentation.
+ *
+ * Built with GEGL_PNG_TRACE defined, every query, load and save is written
+ * as a chrome://tracing event to the file named by GEGL_PNG_LOAD_TRACE or
+ * GEGL_PNG_SAVE_TRACE, with the calls and exclusive time of each phase.
+ */
+#ifdef GEGL_PNG_TRACE
+typedef enum
+{
+  PNG_PHASE_IO,
+  PNG_PHASE_LIBPNG,
+  PNG_PHASE_BANDS,
+  PNG_PHASE_ICC,
+  PNG_PHASE_BUFFER,
+  PNG_N_PHASES
+} PngPhase;
+
+typedef struct
+{
+  const gchar *name;
+  gint64       start;
+  gint64       time[PNG_N_PHASES];
+  guint64      calls[PNG_N_PHASES];
+  guint64      bytes;
+  gint64       nested;      /* time of the spans ended in the open one */
+} PngStats;
+
+static inline gint64
+png_stats_enter (PngStats *stats)
+{
+  gint64 outer = stats->nested;
+
+  stats->nested = 0;
+
+  return outer;
+}
+
+/* accounts the span to @phase less the spans nested in it */
+static inline void
+png_stats_add (PngStats *stats,
+               PngPhase  phase,
+               gint64    start,
+               gint64    outer,
+               gsize     bytes)
+{
+  gint64 elapsed = g_get_monotonic_time () - start;
+
+  stats->time[phase] += elapsed - stats->nested;
+  stats->calls[phase]++;
+  stats->bytes       += bytes;
+  stats->nested       = outer + elapsed;
+}
+
+G_LOCK_DEFINE_STATIC (png_trace);
+
+/* appends @stats to the trace file named by the environment variable
+ * @variable
+ */
+static void
+png_stats_emit (const PngStats *stats,
+                const gchar    *variable)
+{
+  static FILE     *trace  = NULL;
+  static gboolean  opened = FALSE;
+
+  G_LOCK (png_trace);
+
+  if (! opened)
+    {
+      const gchar *path = g_getenv (variable);
+
+      opened = TRUE;
+      if (path && (trace = fopen (path, "w")))
+        fputs ("[\n", trace);
+    }
+
+  /* the closing bracket is optional in the array format */
+  if (trace)
+    {
+      fprintf (trace,
+               "{\"name\":\"%s\",\"cat\":\"png\",\"ph\":\"X\","
+               "\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ","
+               "\"pid\":0,\"tid\":%" G_GUINTPTR_FORMAT ",\"args\":{"
+               "\"io_calls\":%" G_GUINT64_FORMAT ","
+               "\"io_bytes\":%" G_GUINT64_FORMAT ","
+               "\"io_us\":%" G_GINT64_FORMAT ","
+               "\"libpng_calls\":%" G_GUINT64_FORMAT ","
+               "\"libpng_us\":%" G_GINT64_FORMAT ","
+               "\"bands_calls\":%" G_GUINT64_FORMAT ","
+               "\"bands_us\":%" G_GINT64_FORMAT ","
+               "\"icc_calls\":%" G_GUINT64_FORMAT ","
+               "\"icc_us\":%" G_GINT64_FORMAT ","
+               "\"buffer_calls\":%" G_GUINT64_FORMAT ","
+               "\"buffer_us\":%" G_GINT64_FORMAT "}},\n",
+               stats->name, stats->start,
+               g_get_monotonic_time () - stats->start,
+               (guintptr) g_thread_self (),
+               stats->calls[PNG_PHASE_IO], stats->bytes,
+               stats->time[PNG_PHASE_IO],
+               stats->calls[PNG_PHASE_LIBPNG], stats->time[PNG_PHASE_LIBPNG],
+               stats->calls[PNG_PHASE_BANDS], stats->time[PNG_PHASE_BANDS],
+               stats->calls[PNG_PHASE_ICC], stats->time[PNG_PHASE_ICC],
+               stats->calls[PNG_PHASE_BUFFER], stats->time[PNG_PHASE_BUFFER]);
+      fflush (trace);
+    }
+
+  G_UNLOCK (png_trace);
+}
+
+#define PNG_TRACE(stats, phase, bytes, ...) \
+  G_STMT_START { \
+    PngStats *png_trace_stats = (stats); \
+    gint64    png_trace_outer = png_stats_enter (png_trace_stats); \
+    gint64    png_trace_start = g_get_monotonic_time (); \
+    __VA_ARGS__; \
+    png_stats_add (png_trace_stats, (phase), png_trace_start, \
+                   png_trace_outer, (bytes)); \
+  } G_STMT_END
+#else
+#define PNG_TRACE(stats, phase, bytes, ...) \
+  G_STMT_START { __VA_ARGS__; } G_STMT_END
+#endif
+
+/* the statistics of the load or save @png belongs to */
+#define PNG_STATS(png) ((PngStats *) png_get_error_ptr (png))
+
+#endif /* __GEGL_PNG_COMMON_H__ */
@@ -0,0 +1,62 @@
+/* This file is an image processing operation for GEGL
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef GEGL_PROPERTIES
+
+property_string (paths, _("Files"), "")
+  description (_("Paths or URIs of the files to load, one per line."))
+property_int (index, _("Index"), 0)
+  description (_("File whose image is the output, counting from 0."))
+  value_range (0, G_MAXINT)
+property_format (format, _("Format"), NULL)
+  description (_("Pixel format of the outputs, in the color space of "
+                 "their files.  The format of each file if unset."))
+property_boolean (trusted, _("Trusted"), FALSE)
+  description (_("Skip verifying the checksums of the files, and map "
+                 "local files instead of reading them.  A trusted file "
+                 "must not be truncated while it loads."))
+property_object (cancellable, _("Cancellable"), G_TYPE_CANCELLABLE)
+  description (_("Cancelling it makes the loads not done yet fail."))
+property_int (max_pixels, _("Maximum pixels"), 0)
+  description (_("Files with more pixels fail to load, 0 for no limit."))
+  value_range (0, G_MAXINT)
+property_int (max_memory, _("Maximum memory"), 0)
+  description (_("Memory in megabytes decoding one file may take; larger "
+                 "images are decoded at a reduced resolution that fits.  "
+                 "0 for no limit."))
+  value_range (0, G_MAXINT)
+property_int (max_chunk_size, _("Maximum chunk size"), 0)
+  description (_("Size in kilobytes an ancillary chunk may take once "
+                 "decompressed, 0 for the limit of libpng."))
+  value_range (0, G_MAXINT)
+property_pointer (buffers, _("Buffers"),
+                  _("Array with room for a GeglBuffer per file, filled "
+                    "with a new reference to each loaded buffer, NULL for "
+                    "the files that failed to load"))
+property_pointer (errors, _("Errors"),
+                  _("Array with room for a GError per file, filled with "
+                    "why the files failed to load, NULL for the others"))
+
+#else
+
+#define GEGL_OP_SOURCE
+#define GEGL_OP_NAME png_load_batch
+#define GEGL_OP_C_SOURCE png-load-batch.c
+#define PNG_LOAD_BATCH
+
+#include "png-load.c"
+
+#endif
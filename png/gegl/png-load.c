@@ -18,6 +18,11 @@
  *           2006 Kevin Cozens <kcozens@cvs.gnome.org>
  */
 
+/* for adler32_combine64 () with a 64 bit length in <zlib.h> */
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#endif
+
 #include "config.h"
 #include <glib/gi18n-lib.h>
 #include <gegl-gio-private.h>
@@ -28,15 +33,49 @@ property_file_path (path, _("File"), "")
   description (_("Path of file to load."))
 property_uri (uri, _("URI"), "")
   description (_("URI for file to load."))
+property_format (format, _("Format"), NULL)
+  description (_("Pixel format of the output, in the color space of the "
+                 "file.  The format of the file if unset."))
+property_boolean (trusted, _("Trusted"), FALSE)
+  description (_("Skip verifying the checksums of the file, and map "
+                 "local files instead of reading them.  A trusted file "
+                 "must not be truncated while it loads."))
+property_object (cancellable, _("Cancellable"), G_TYPE_CANCELLABLE)
+  description (_("Cancelling it makes the load fail."))
+property_int (frame, _("Frame"), 0)
+  description (_("Frame of an animated png to load, counting from 0."))
+  value_range (0, G_MAXINT)
+property_int (max_pixels, _("Maximum pixels"), 0)
+  description (_("Files with more pixels fail to load, 0 for no limit."))
+  value_range (0, G_MAXINT)
+property_int (max_memory, _("Maximum memory"), 0)
+  description (_("Memory in megabytes decoding may take; larger images "
+                 "are decoded at a reduced resolution that fits.  0 for "
+                 "no limit."))
+  value_range (0, G_MAXINT)
+property_int (max_chunk_size, _("Maximum chunk size"), 0)
+  description (_("Size in kilobytes an ancillary chunk may take once "
+                 "decompressed, 0 for the limit of libpng."))
+  value_range (0, G_MAXINT)
 
 #else
 
+/* png-load-batch.c builds gegl:png-load-batch from this file */
+#ifndef PNG_LOAD_BATCH
 #define GEGL_OP_SOURCE
 #define GEGL_OP_NAME png_load
 #define GEGL_OP_C_SOURCE png-load.c
+#endif
 
 #include "gegl-op.h"
 #include <png.h>
+#include <zlib.h>
+#include "png-common.h"
+#ifdef G_OS_UNIX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 
 #define WARN_IF_ERROR(gerror) \
@@ -48,7 +87,8 @@ do { \
 
 typedef enum {
   LOAD_PNG_TOO_SHORT,
-  LOAD_PNG_WRONG_HEADER
+  LOAD_PNG_WRONG_HEADER,
+  LOAD_PNG_FAILED
 } LoadPngErrors;
 
 static GQuark error_quark(void)
@@ -56,37 +96,610 @@ static GQuark error_quark(void)
   return g_quark_from_static_string ("gegl:load-png-error-quark");
 }
 
+/* Bounds on what a load may allocate */
+typedef struct
+{
+  guint64       max_pixels;  /* 0 for no limit */
+  guint64       max_memory;  /* in bytes, 0 for no limit */
+  gsize         max_chunk;   /* in bytes, 0 for the limit of libpng */
+} PngLimits;
+
+/* upper bound of the memory a load of @w x @h pixels, reduced by @shrink
+ * levels, takes: the output and the rows it is decoded through
+ */
+static guint64
+limits_estimate (png_uint_32 w,
+                 png_uint_32 h,
+                 gint        shrink,
+                 gint        bpp,
+                 gint        out_bpp,
+                 gint        band_height,
+                 gboolean    interlaced)
+{
+  guint64 width  = ((w - 1) >> shrink) + 1;
+  guint64 height = ((h - 1) >> shrink) + 1;
+  guint64 rows   = MIN ((guint64) MAX (band_height, 1), height);
+  guint64 bytes  = width * height * out_bpp;
+
+  if (shrink == 0)
+    {
+      bytes += (guint64) w * bpp * rows + rows * 2 * sizeof (gpointer);
+      if (interlaced)
+        bytes += (guint64) w * bpp * ((h + 1) / 2) + h * sizeof (gpointer);
+    }
+  else
+    {
+      bytes += width * bpp * rows;
+      if (interlaced)
+        bytes += (guint64) w * bpp * height + h * sizeof (gpointer);
+      else
+        bytes += (guint64) w * bpp + width * bpp * sizeof (guint64);
+    }
+
+  return bytes;
+}
+
+/* the levels to reduce by to fit in @max_memory, -1 if nothing fits */
+static gint
+limits_shrink (guint64     max_memory,
+               png_uint_32 w,
+               png_uint_32 h,
+               gint        bpp,
+               gint        out_bpp,
+               gint        band_height,
+               gboolean    interlaced)
+{
+  gint shrink;
+
+  if (! max_memory)
+    return 0;
+
+  for (shrink = 0; shrink < 32; shrink++)
+    if (limits_estimate (w, h, shrink, bpp, out_bpp, band_height,
+                         interlaced) <= max_memory)
+      return shrink;
+  return -1;
+}
+
+/* fails the load if the image, reduced by @shrink levels, is over @limits */
+static void
+limits_check (png_structp      png,
+              const PngLimits *limits, // can be NULL
+              png_uint_32      w,
+              png_uint_32      h,
+              gint             shrink,
+              gint             bpp,
+              gint             out_bpp,
+              gint             band_height,
+              gboolean         interlaced)
+{
+  if (! limits)
+    return;
+
+  if (limits->max_pixels && (guint64) w * h > limits->max_pixels)
+    png_error (png, "image has more pixels than allowed");
+
+  if (limits->max_memory &&
+      limits_estimate (w, h, shrink, bpp, out_bpp, band_height,
+                       interlaced) > limits->max_memory)
+    png_error (png, "image needs more memory than allowed");
+}
+
+typedef struct
+{
+  GFile        *file;
+  GInputStream *stream;
+  GMappedFile  *mapped;
+  guchar       *buffer;
+  const guchar *data;
+  gsize         length;
+  gsize         offset;
+  GCancellable *cancellable;
+  GMainContext *context;
+  guchar       *prefetch;    /* the block being read ahead */
+  gboolean      pending;
+  gssize        prefetched;
+  GError       *error;       /* of the read ahead */
+  const PngLimits *limits;   /* of the load, can be NULL */
+} PngReader;
+
+/* Input of a load.  Regular local files of trusted loads are mapped,
+ * everything else is read in blocks, the next one asynchronously while
+ * the current one is decoded.  A mapped file that shrinks under the load
+ * faults the process with SIGBUS, which is why untrusted loads never map.
+ */
+#define READER_BUFFER_SIZE (64 * 1024)
+
+static void
+reader_prefetch_ready (GObject      *stream,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  PngReader *reader = user_data;
+
+  reader->prefetched = g_input_stream_read_finish (G_INPUT_STREAM (stream),
+                                                   result, &reader->error);
+  reader->pending = FALSE;
+}
+
+static void
+reader_prefetch (PngReader *reader)
+{
+  reader->pending = TRUE;
+
+  g_main_context_push_thread_default (reader->context);
+  g_input_stream_read_async (reader->stream, reader->prefetch,
+                             READER_BUFFER_SIZE, G_PRIORITY_DEFAULT,
+                             reader->cancellable, reader_prefetch_ready,
+                             reader);
+  g_main_context_pop_thread_default (reader->context);
+}
+
+static void
+reader_wait (PngReader *reader)
+{
+  while (reader->pending)
+    g_main_context_iteration (reader->context, TRUE);
+}
+
+/* maps @path if it is a regular file, pipes and devices are not */
+static GMappedFile *
+reader_map (const gchar *path)
+{
+  GMappedFile *mapped = NULL;
+#ifdef G_OS_UNIX
+  struct stat  st;
+  gint         fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0)
+    mapped = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+  close (fd);
+#else
+  if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
+    mapped = g_mapped_file_new (path, FALSE, NULL);
+#endif
+
+  return mapped;
+}
+
+static gboolean
+reader_open (PngReader    *reader,
+             const gchar  *uri,
+             const gchar  *path,
+             gboolean      trusted,
+             GCancellable *cancellable,
+             GError      **err)
+{
+  memset (reader, 0, sizeof (PngReader));
+  reader->cancellable = cancellable;
+
+  if (trusted && (uri == NULL || uri[0] == '\0') &&
+      path != NULL && path[0] != '\0' && strcmp (path, "-"))
+    {
+      reader->mapped = reader_map (path);
+      if (reader->mapped)
+        {
+          reader->data   = (const guchar *)
+                           g_mapped_file_get_contents (reader->mapped);
+          reader->length = g_mapped_file_get_length (reader->mapped);
+          return TRUE;
+        }
+    }
+
+  reader->stream = gegl_gio_open_input_stream (uri, path, &reader->file, err);
+  if (! reader->stream)
+    {
+      g_clear_object (&reader->file);
+      return FALSE;
+    }
+  reader->buffer   = g_malloc (READER_BUFFER_SIZE);
+  reader->prefetch = g_malloc (READER_BUFFER_SIZE);
+  reader->data     = reader->buffer;
+  reader->context  = g_main_context_new ();
+  reader_prefetch (reader);
+
+  return TRUE;
+}
+
+static void
+reader_close (PngReader *reader)
+{
+  if (reader->stream)
+    {
+      reader_wait (reader);
+      g_input_stream_close (reader->stream, NULL, NULL);
+    }
+  g_clear_object (&reader->stream);
+  g_clear_object (&reader->file);
+  g_clear_pointer (&reader->mapped, g_mapped_file_unref);
+  g_clear_pointer (&reader->buffer, g_free);
+  g_clear_pointer (&reader->prefetch, g_free);
+  g_clear_pointer (&reader->context, g_main_context_unref);
+  g_clear_error (&reader->error);
+  reader->data   = NULL;
+  reader->length = 0;
+  reader->offset = 0;
+}
+
+/* moves on to the block read ahead, returns its size, 0 at the end of the
+ * input and -1 on errors
+ */
+static gssize
+reader_fill (PngReader  *reader,
+             GError    **err)
+{
+  guchar *swap;
+
+  if (! reader->stream)
+    return 0;
+
+  reader_wait (reader);
+  if (reader->prefetched <= 0)
+    {
+      if (reader->error)
+        {
+          g_propagate_error (err, reader->error);
+          reader->error = NULL;
+          reader->prefetched = -1;
+        }
+      reader->length = 0;
+      reader->offset = 0;
+      return reader->prefetched;
+    }
+
+  swap             = reader->buffer;
+  reader->buffer   = reader->prefetch;
+  reader->prefetch = swap;
+  reader->data     = reader->buffer;
+  reader->length   = reader->prefetched;
+  reader->offset   = 0;
+
+  reader_prefetch (reader);
+
+  return reader->length;
+}
+
+static gsize
+reader_read (PngReader  *reader,
+             guchar     *dest,
+             gsize       length,
+             GError    **err)
+{
+  gsize done = 0;
+
+  if (g_cancellable_set_error_if_cancelled (reader->cancellable, err))
+    return 0;
+
+  while (done < length)
+    {
+      gsize n;
+
+      if (reader->offset == reader->length &&
+          reader_fill (reader, err) <= 0)
+        break;
+
+      n = MIN (length - done, reader->length - reader->offset);
+      memcpy (dest + done, reader->data + reader->offset, n);
+      reader->offset += n;
+      done           += n;
+    }
+
+  return done;
+}
+
+/* all of the input at once */
+static GBytes *
+reader_contents (PngReader  *reader,
+                 GError    **err)
+{
+  GByteArray *contents;
+  gssize      got;
+
+  if (reader->mapped)
+    return g_mapped_file_get_bytes (reader->mapped);
+
+  contents = g_byte_array_new ();
+  g_byte_array_append (contents, reader->data + reader->offset,
+                       reader->length - reader->offset);
+  reader->offset = reader->length;
+
+  while ((got = reader_fill (reader, err)) > 0)
+    g_byte_array_append (contents, reader->data, got);
+
+  if (got < 0)
+    {
+      g_byte_array_free (contents, TRUE);
+      return NULL;
+    }
+  return g_byte_array_free_to_bytes (contents);
+}
+
 static void
 read_fn(png_structp png_ptr, png_bytep buffer, png_size_t length)
 {
   GError *err = NULL;
-  GInputStream *stream = G_INPUT_STREAM(png_get_io_ptr(png_ptr));
-  gsize bytes_read = 0;
-  g_assert(stream);
+  PngReader *reader = png_get_io_ptr(png_ptr);
+  gsize      got;
+  g_assert(reader);
 
-  g_input_stream_read_all(stream, buffer, length, &bytes_read, NULL, &err);
-  if (err) {
-    g_printerr("gegl:load-png %s: %s\n", __PRETTY_FUNCTION__, err->message);
-  }
+  PNG_TRACE (PNG_STATS (png_ptr), PNG_PHASE_IO, length,
+             got = reader_read (reader, buffer, length, &err));
+  if (got < length)
+    {
+      if (err) {
+        g_printerr("gegl:load-png %s: %s\n", __PRETTY_FUNCTION__, err->message);
+        g_error_free (err);
+      }
+      png_error (png_ptr, "unexpected end of file");
+    }
+}
+
+/* Allocations of a load.  Every thread keeps a block the read structs of
+ * libpng and the row buffers are carved out of while a load runs on it,
+ * reset in one go once it is done; what does not fit is allocated as usual.
+ */
+#define PNG_ARENA_SIZE (512 * 1024)
+
+typedef struct
+{
+  guchar *data;
+  gsize   used;
+  gint    depth;
+} PngArena;
+
+static void
+arena_destroy (gpointer data)
+{
+  PngArena *arena = data;
+
+  g_free (arena->data);
+  g_free (arena);
+}
+
+static GPrivate png_arena_key = G_PRIVATE_INIT (arena_destroy);
+
+static void
+arena_acquire (void)
+{
+  PngArena *arena = g_private_get (&png_arena_key);
+
+  if (! arena)
+    {
+      arena = g_new0 (PngArena, 1);
+      arena->data = g_malloc (PNG_ARENA_SIZE);
+      g_private_set (&png_arena_key, arena);
+    }
+
+  arena->depth++;
+}
+
+/* everything allocated from the arena must be released by now */
+static void
+arena_release (void)
+{
+  PngArena *arena = g_private_get (&png_arena_key);
+
+  if (--arena->depth == 0)
+    arena->used = 0;
+}
+
+/* the arena of the calling thread, if a load is running on it */
+static PngArena *
+arena_current (void)
+{
+  PngArena *arena = g_private_get (&png_arena_key);
+
+  return arena && arena->depth ? arena : NULL;
+}
+
+static gpointer
+arena_alloc (PngArena *arena,
+             gsize     size)
+{
+  gpointer ptr;
+
+  size = (size + 15) & ~(gsize) 15;
+  if (! arena || size > PNG_ARENA_SIZE - arena->used)
+    return NULL;
+
+  ptr = arena->data + arena->used;
+  arena->used += size;
+
+  return ptr;
+}
+
+/* NULL if @size could not be allocated */
+static gpointer
+arena_alloc0 (PngArena *arena,
+              gsize     size)
+{
+  gpointer ptr = arena_alloc (arena, size);
+
+  if (ptr)
+    return memset (ptr, 0, size);
+  return g_try_malloc0 (size);
+}
+
+static void
+arena_free (PngArena *arena,
+            gpointer  ptr)
+{
+  if (! arena ||
+      (guchar *) ptr < arena->data ||
+      (guchar *) ptr >= arena->data + PNG_ARENA_SIZE)
+    g_free (ptr);
+}
+
+static png_voidp
+arena_malloc_fn (png_structp      png_ptr,
+                 png_alloc_size_t size)
+{
+  gpointer ptr = arena_alloc (png_get_mem_ptr (png_ptr), size);
+
+  return ptr ? ptr : g_try_malloc (size);
+}
+
+static void
+arena_free_fn (png_structp png_ptr,
+               png_voidp   ptr)
+{
+  arena_free (png_get_mem_ptr (png_ptr), ptr);
+}
+
+/* State of a single query or load.  libpng errors are recorded in it and
+ * unwind to the setjmp of its caller.
+ */
+typedef struct
+{
+#ifdef GEGL_PNG_TRACE
+  PngStats     stats;       /* first, for PNG_STATS () */
+#endif
+  png_structp  png;
+  png_infop    info;
+  gchar       *message;
+  PngArena    *arena;       /* what is owned is allocated from */
+  GPtrArray   *owned;
+  GeglBufferIterator *iterator; /* holding tiles that rows are decoded to */
+} PngContext;
+
+static void
+error_fn (png_structp     png_ptr,
+          png_const_charp msg)
+{
+  PngContext *ctx = png_get_error_ptr (png_ptr);
+
+  /* the first error is the interesting one */
+  if (! ctx->message)
+    ctx->message = g_strdup (msg);
+
+  png_longjmp (png_ptr, 1);
+}
+
+static PngContext *
+context_new (const gchar     *name, // of the trace event
+             gboolean         trusted,
+             const PngLimits *limits) // can be NULL
+{
+  PngContext *ctx = g_new0 (PngContext, 1);
+
+#ifdef GEGL_PNG_TRACE
+  ctx->stats.name  = name;
+  ctx->stats.start = g_get_monotonic_time ();
+#endif
+
+  ctx->arena = arena_current ();
+  ctx->png   = png_create_read_struct_2 (PNG_LIBPNG_VER_STRING, ctx,
+                                         error_fn, NULL, ctx->arena,
+                                         arena_malloc_fn, arena_free_fn);
+  if (ctx->png)
+    ctx->info = png_create_info_struct (ctx->png);
+
+  if (! ctx->info)
+    {
+      png_destroy_read_struct (&ctx->png, NULL, NULL);
+      g_free (ctx);
+      return NULL;
+    }
+
+  ctx->owned = g_ptr_array_new ();
+
+  png_set_benign_errors (ctx->png, TRUE);
+  png_set_option (ctx->png, PNG_SKIP_sRGB_CHECK_PROFILE, PNG_OPTION_ON);
+
+  /* libpng does not even compute the checksums it does not check */
+  if (trusted)
+    {
+      png_set_crc_action (ctx->png, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+#ifdef PNG_IGNORE_ADLER32
+      png_set_option (ctx->png, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+#endif
+    }
+
+#ifdef PNG_SET_USER_LIMITS_SUPPORTED
+  /* neither side of an image can be longer than the number of its
+   * pixels, which libpng rejects while reading IHDR already
+   */
+  if (limits && limits->max_pixels)
+    png_set_user_limits (ctx->png,
+                         MIN (limits->max_pixels, PNG_USER_WIDTH_MAX),
+                         MIN (limits->max_pixels, PNG_USER_HEIGHT_MAX));
+  if (limits && limits->max_chunk)
+    png_set_chunk_malloc_max (ctx->png, limits->max_chunk);
+#endif
+
+  return ctx;
+}
+
+/* zeroed memory that lives until it is passed to context_release () or
+ * the context is destroyed, whichever comes first.  NULL if out of memory.
+ */
+static gpointer
+context_alloc0 (PngContext *ctx,
+                gsize       size)
+{
+  gpointer ptr = arena_alloc0 (ctx->arena, size);
+
+  if (ptr)
+    g_ptr_array_add (ctx->owned, ptr);
+
+  return ptr;
 }
 
 static void
-error_fn(png_structp png_ptr, png_const_charp msg)
+context_release (PngContext *ctx,
+                 gpointer    ptr)
+{
+  if (ptr && g_ptr_array_remove_fast (ctx->owned, ptr))
+    arena_free (ctx->arena, ptr);
+}
+
+/* frees the context along with everything it owns, turning a recorded
+ * libpng error into @err.  Returns -1 if there was an error, 0 otherwise.
+ */
+static gint
+context_destroy (PngContext  *ctx,
+                 GError     **err)
 {
-  g_printerr("LIBPNG ERROR: %s", msg);
+  gint status = ctx->message ? -1 : 0;
+  guint i;
+
+  if (ctx->iterator)
+    gegl_buffer_iterator_stop (ctx->iterator);
+
+  png_destroy_read_struct (&ctx->png, &ctx->info, NULL);
+
+#ifdef GEGL_PNG_TRACE
+  png_stats_emit (&ctx->stats, "GEGL_PNG_LOAD_TRACE");
+#endif
+
+  for (i = 0; i < ctx->owned->len; i++)
+    arena_free (ctx->arena, g_ptr_array_index (ctx->owned, i));
+  g_ptr_array_free (ctx->owned, TRUE);
+
+  if (ctx->message)
+    g_set_error (err, error_quark (), LOAD_PNG_FAILED, "%s", ctx->message);
+
+  g_free (ctx->message);
+  g_free (ctx);
+
+  return status;
 }
 
 static gboolean
-check_valid_png_header(GInputStream *stream, GError **err)
+check_valid_png_header(PngReader *reader, GError **err)
 {
   const size_t hdr_size=8;
-  gssize hdr_read_size;
+  gsize hdr_read_size;
   unsigned char header[hdr_size];
+  GError *read_err = NULL;
 
-  hdr_read_size = g_input_stream_read(G_INPUT_STREAM(stream), header, hdr_size, NULL, err);
-  if (hdr_read_size == -1)
+  hdr_read_size = reader_read(reader, header, hdr_size, &read_err);
+  if (read_err)
     {
-      // err should be set by _read()
+      g_propagate_error (err, read_err);
       return FALSE;
     }
   else if (hdr_read_size < hdr_size)
@@ -111,6 +724,24 @@ check_valid_png_header(GInputStream *stream, GError **err)
   return TRUE;
 }
 
+/* skips the ancillary chunks that have no bearing on the pixels */
+static void
+skip_ancillary_chunks (png_structp load_png_ptr,
+                       gboolean    keep_icc)
+{
+#ifdef PNG_HANDLE_AS_UNKNOWN_SUPPORTED
+  static const png_byte ancillary[] =
+    "bKGD\0" "eXIf\0" "hIST\0" "iTXt\0" "oFFs\0" "pCAL\0" "pHYs\0"
+    "sBIT\0" "sCAL\0" "sPLT\0" "tEXt\0" "tIME\0" "zTXt\0";
+
+  png_set_keep_unknown_chunks (load_png_ptr, PNG_HANDLE_CHUNK_NEVER,
+                               ancillary, sizeof (ancillary) / 5);
+  if (! keep_icc)
+    png_set_keep_unknown_chunks (load_png_ptr, PNG_HANDLE_CHUNK_NEVER,
+                                 (png_const_bytep) "iCCP", 1);
+#endif
+}
+
 static const Babl *
 get_babl_format(int bit_depth, int color_type, const Babl *space)
 {
@@ -159,6 +790,50 @@ get_babl_format(int bit_depth, int color_type, const Babl *space)
 }
 
 
+/* spaces resolved from iCCP and gAMA/cHRM chunks, shared by all loads */
+#define SPACE_CACHE_MAX_ENTRIES 64
+
+G_LOCK_DEFINE_STATIC (space_cache);
+static GHashTable *space_cache = NULL;
+
+typedef struct
+{
+  gchar   tag[4];
+  gdouble values[9];
+} ChromaticitiesKey;
+
+static gboolean
+space_cache_lookup (GBytes      *key,
+                    const Babl **space)
+{
+  gpointer value = NULL;
+  gboolean found = FALSE;
+
+  G_LOCK (space_cache);
+  if (space_cache)
+    found = g_hash_table_lookup_extended (space_cache, key, NULL, &value);
+  G_UNLOCK (space_cache);
+
+  *space = value;
+  return found;
+}
+
+static void
+space_cache_insert (gconstpointer  data,
+                    gsize          size,
+                    const Babl    *space)
+{
+  G_LOCK (space_cache);
+  if (! space_cache)
+    space_cache = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                         (GDestroyNotify) g_bytes_unref,
+                                         NULL);
+  if (g_hash_table_size (space_cache) < SPACE_CACHE_MAX_ENTRIES)
+    g_hash_table_insert (space_cache, g_bytes_new (data, size),
+                         (gpointer) space);
+  G_UNLOCK (space_cache);
+}
+
 static const Babl *
 gegl_png_space (png_structp load_png_ptr,
                 png_infop   load_info_ptr)
@@ -171,8 +846,20 @@ gegl_png_space (png_structp load_png_ptr,
       PNG_INFO_iCCP)
     {
       const char *error = NULL;
-      return babl_space_from_icc ((char*)profile, (int)proflen,
-                                 BABL_ICC_INTENT_RELATIVE_COLORIMETRIC, &error);
+      const Babl *space;
+      GBytes     *key = g_bytes_new_static (profile, proflen);
+      gboolean    found = space_cache_lookup (key, &space);
+
+      g_bytes_unref (key);
+      if (found)
+        return space;
+
+      PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_ICC, 0,
+                 space = babl_space_from_icc ((char*)profile, (int)proflen,
+                                              BABL_ICC_INTENT_RELATIVE_COLORIMETRIC,
+                                              &error));
+      space_cache_insert (profile, proflen, space);
+      return space;
     }
 
   if (png_get_valid (load_png_ptr, load_info_ptr, PNG_INFO_sRGB))
@@ -189,6 +876,11 @@ gegl_png_space (png_structp load_png_ptr,
       double green[2]= {0.3000, 0.6000};
       double blue[2]={0.1500, 0.0600};
       double gamma;
+      ChromaticitiesKey  chrm;
+      const Babl        *space;
+      GBytes            *key;
+      gboolean           found;
+
       png_get_gAMA(load_png_ptr, load_info_ptr, &gamma);
 
       if (png_get_valid(load_png_ptr, load_info_ptr, PNG_INFO_cHRM))
@@ -199,252 +891,1980 @@ gegl_png_space (png_structp load_png_ptr,
                      &green[0], &green[1],
                      &blue[0], &blue[1]);
       }
-      return babl_space_from_chromaticities (NULL, wp[0], wp[1],
-                                             red[0], red[1],
-                                             green[0], green[1],
-                                             blue[0], blue[1],
-                                             babl_trc_gamma (1.0/gamma),
-                                             babl_trc_gamma (1.0/gamma),
-                                             babl_trc_gamma (1.0/gamma),
-                                             1);
+
+      /* zero the padding too, the key is hashed bytewise */
+      memset (&chrm, 0, sizeof (chrm));
+      memcpy (chrm.tag, "cHRM", 4);
+      chrm.values[0] = wp[0];    chrm.values[1] = wp[1];
+      chrm.values[2] = red[0];   chrm.values[3] = red[1];
+      chrm.values[4] = green[0]; chrm.values[5] = green[1];
+      chrm.values[6] = blue[0];  chrm.values[7] = blue[1];
+      chrm.values[8] = gamma;
+
+      key   = g_bytes_new_static (&chrm, sizeof (chrm));
+      found = space_cache_lookup (key, &space);
+      g_bytes_unref (key);
+      if (found)
+        return space;
+
+      space = babl_space_from_chromaticities (NULL, wp[0], wp[1],
+                                              red[0], red[1],
+                                              green[0], green[1],
+                                              blue[0], blue[1],
+                                              babl_trc_gamma (1.0/gamma),
+                                              babl_trc_gamma (1.0/gamma),
+                                              babl_trc_gamma (1.0/gamma),
+                                              1);
+      space_cache_insert (&chrm, sizeof (chrm), space);
+      return space;
     }
 
   return NULL;
 }
 
-static gint
-gegl_buffer_import_png (GeglBuffer  *gegl_buffer,
-                        GInputStream *stream,
-                        gint         dest_x,
-                        gint         dest_y,
-                        gint        *ret_width,
-                        gint        *ret_height,
-                        const Babl  *format, // can be NULL
-                        GError **err)
-{
-  gint           width;
-  gint           bit_depth;
-  gint           bpp;
-  gint           number_of_passes=1;
-  const Babl    *space = NULL;
-  png_uint_32    w;
-  png_uint_32    h;
-  png_structp    load_png_ptr;
-  png_infop      load_info_ptr;
-  guchar        *pixels;
-  /*png_bytep     *rows;*/
-
-
-  unsigned   int i;
-  png_bytep  *row_p = NULL;
+/* Band-parallel decoding of files whose image data gegl:png-save split into
+ * bands of rows, each on a full flush boundary, with a gePB chunk holding
+ * the rows per band and the offset of every band in the IDAT payload.
+ */
+/* largest band a worker inflates when the load has no memory budget */
+#define PNG_BANDS_MAX_SCRATCH ((guint64) 256 << 20)
 
-  g_return_val_if_fail(stream, -1);
+typedef struct
+{
+  const guchar  *idat;        /* IDAT payload, one zlib stream */
+  gsize          idat_length;
+  guchar        *idat_copy;   /* set if the payload had to be gathered */
+  guint32        band_rows;
+  guint32        n_bands;
+  const guchar  *offsets;
+  gboolean       verify;      /* check CRCs and the adler32 */
+} PngBands;
+
+typedef struct
+{
+  const PngBands *bands;
+  GeglBuffer     *buffer;
+  const Babl     *format;
+  GeglRectangle   region;
+  png_uint_32     height;
+  gsize           rowbytes;
+  gint            filter_bpp;
+  gint            bit_depth;
+  guint32         first_band;
+  guint32        *adlers;
+  gint            failed;
+} PngBandsJob;
+
+/* gathers the IDAT payload of the file in @data, checking the CRC of every
+ * IDAT chunk since libpng never gets to see them, unless the file is
+ * trusted.
+ */
+static gboolean
+bands_collect_idat (PngBands     *bands,
+                    const guchar *data,
+                    gsize         length)
+{
+  gsize pos    = 8;
+  gsize total  = 0;
+  gint  n_idat = 0;
+  gsize first  = 0;
+  gsize end;
 
-  if (!check_valid_png_header(stream, err))
+  for (end = pos; end + 12 <= length; )
     {
-      return -1;
+      guint32 chunk_length = png_get_u32 (data + end);
+
+      if (chunk_length > length - end - 12)
+        return FALSE;
+
+      if (! memcmp (data + end + 4, "IDAT", 4))
+        {
+          if (bands->verify &&
+              crc32 (0, data + end + 4, chunk_length + 4) !=
+              png_get_u32 (data + end + 8 + chunk_length))
+            return FALSE;
+          if (n_idat++ == 0)
+            first = end;
+          total += chunk_length;
+        }
+      else if (n_idat)
+        {
+          break;
+        }
+      end += (gsize) chunk_length + 12;
     }
 
-  load_png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, error_fn, NULL);
+  if (n_idat == 0)
+    return FALSE;
 
-  if (!load_png_ptr)
+  if (n_idat == 1)
     {
-      return -1;
+      bands->idat        = data + first + 8;
+      bands->idat_length = total;
+      return TRUE;
     }
 
-  load_info_ptr = png_create_info_struct (load_png_ptr);
-  if (!load_info_ptr)
-    {
-      png_destroy_read_struct (&load_png_ptr, &load_info_ptr, NULL);
-      return -1;
-    }
-  png_set_benign_errors (load_png_ptr, TRUE);
-  png_set_option (load_png_ptr, PNG_SKIP_sRGB_CHECK_PROFILE, PNG_OPTION_ON);
+  bands->idat_copy   = g_malloc (total);
+  bands->idat        = bands->idat_copy;
+  bands->idat_length = total;
 
-  if (setjmp (png_jmpbuf (load_png_ptr)))
+  for (pos = first, total = 0; pos < end; )
     {
-      png_destroy_read_struct (&load_png_ptr, &load_info_ptr, NULL);
-      g_free (row_p);
-      return -1;
+      guint32 chunk_length = png_get_u32 (data + pos);
+
+      memcpy (bands->idat_copy + total, data + pos + 8, chunk_length);
+      total += chunk_length;
+      pos   += (gsize) chunk_length + 12;
     }
 
-  png_set_read_fn(load_png_ptr, stream, read_fn);
+  return TRUE;
+}
+
+static void
+bands_clear (PngBands *bands)
+{
+  g_clear_pointer (&bands->idat_copy, g_free);
+}
+
+static gboolean
+bands_find (PngBands    *bands,
+            png_structp  load_png_ptr,
+            png_infop    load_info_ptr,
+            PngReader   *reader,
+            png_uint_32  height,
+            gboolean     verify,
+            guint64      headroom) // for the scratch of the workers
+{
+#ifdef PNG_STORE_UNKNOWN_CHUNKS_SUPPORTED
+  png_unknown_chunkp unknowns = NULL;
+  gint               n_unknowns;
+  gint               i;
+#endif
+
+  memset (bands, 0, sizeof (PngBands));
+  bands->verify = verify;
+
+#ifdef PNG_STORE_UNKNOWN_CHUNKS_SUPPORTED
+  if (! reader->mapped)
+    return FALSE;
+
+  n_unknowns = png_get_unknown_chunks (load_png_ptr, load_info_ptr, &unknowns);
+  for (i = 0; i < n_unknowns; i++)
+    {
+      const guchar *payload = unknowns[i].data;
+      gsize         size    = unknowns[i].size;
+      guint32       b;
+      guint64       band_size;
+
+      if (memcmp (unknowns[i].name, PNG_BANDS_CHUNK, 4) || size < 8)
+        continue;
+
+      bands->band_rows = png_get_u32 (payload);
+      bands->n_bands   = (size - 4) / 4;
+      bands->offsets   = payload + 4;
+
+      /* the row buffers of the workers are sized by the band height */
+      if (bands->band_rows == 0 || bands->band_rows > height ||
+          bands->n_bands != (height - 1) / bands->band_rows + 1)
+        return FALSE;
+
+      /* zlib counts the output of a band in a uInt */
+      band_size = (guint64) (png_get_rowbytes (load_png_ptr, load_info_ptr) +
+                             1) * bands->band_rows;
+      if (band_size > G_MAXUINT ||
+          (headroom == G_MAXUINT64 && band_size > PNG_BANDS_MAX_SCRATCH))
+        return FALSE;
+
+      if ((guint64) gegl_config_threads () * band_size +
+          reader->length > headroom)
+        return FALSE;
+
+      if (! bands_collect_idat (bands, reader->data, reader->length))
+        return FALSE;
+
+      /* a zlib header without preset dictionary, and increasing offsets */
+      if (bands->idat_length < 6 ||
+          (bands->idat[0] & 0x0f) != 8 ||
+          (bands->idat[1] & 0x20) ||
+          ((bands->idat[0] << 8) | bands->idat[1]) % 31)
+        {
+          bands_clear (bands);
+          return FALSE;
+        }
+
+      for (b = 0; b < bands->n_bands; b++)
+        {
+          guint32 offset = png_get_u32 (bands->offsets + b * 4);
+          guint32 prev   = b ? png_get_u32 (bands->offsets + (b - 1) * 4) : 1;
+
+          if (offset <= prev || offset >= bands->idat_length - 4)
+            {
+              bands_clear (bands);
+              return FALSE;
+            }
+        }
+
+      return TRUE;
+    }
+#endif
+
+  return FALSE;
+}
+
+static gboolean
+png_unfilter_row (guchar       *row,
+                  const guchar *prev, // NULL for an all zero row
+                  gsize         rowbytes,
+                  gint          bpp,
+                  guint         filter)
+{
+  gsize i;
+
+  switch (filter)
+    {
+      case PNG_FILTER_VALUE_NONE:
+        break;
+
+      case PNG_FILTER_VALUE_SUB:
+        for (i = bpp; i < rowbytes; i++)
+          row[i] += row[i - bpp];
+        break;
+
+      case PNG_FILTER_VALUE_UP:
+        if (prev)
+          for (i = 0; i < rowbytes; i++)
+            row[i] += prev[i];
+        break;
+
+      case PNG_FILTER_VALUE_AVG:
+        for (i = 0; i < rowbytes; i++)
+          {
+            guint a = i >= bpp ? row[i - bpp] : 0;
+            guint b = prev ? prev[i] : 0;
+
+            row[i] += (a + b) >> 1;
+          }
+        break;
+
+      case PNG_FILTER_VALUE_PAETH:
+        for (i = 0; i < rowbytes; i++)
+          {
+            gint a  = i >= bpp ? row[i - bpp] : 0;
+            gint b  = prev ? prev[i] : 0;
+            gint c  = prev && i >= bpp ? prev[i - bpp] : 0;
+            gint p  = a + b - c;
+            gint pa = ABS (p - a);
+            gint pb = ABS (p - b);
+            gint pc = ABS (p - c);
+
+            if (pa <= pb && pa <= pc)
+              row[i] += a;
+            else if (pb <= pc)
+              row[i] += b;
+            else
+              row[i] += c;
+          }
+        break;
+
+      default:
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+bands_decode_range (gsize    offset,
+                    gsize    size,
+                    gpointer user_data)
+{
+  PngBandsJob    *job      = user_data;
+  const PngBands *bands    = job->bands;
+  gsize           stride   = job->rowbytes + 1;
+  guchar         *filtered = g_try_malloc (stride * bands->band_rows);
+  guint32         b;
+
+  /* the caller falls back to libpng, which only needs a band of rows */
+  if (! filtered)
+    {
+      g_atomic_int_set (&job->failed, TRUE);
+      return;
+    }
+
+  for (b = job->first_band + offset;
+       b < job->first_band + offset + size && ! g_atomic_int_get (&job->failed);
+       b++)
+    {
+      guint32       start = png_get_u32 (bands->offsets + b * 4);
+      guint32       end   = b + 1 < bands->n_bands ?
+                            png_get_u32 (bands->offsets + (b + 1) * 4) :
+                            bands->idat_length - 4;
+      png_uint_32   y0    = b * bands->band_rows;
+      png_uint_32   n     = MIN (bands->band_rows, job->height - y0);
+      gsize         expected = stride * n;
+      z_stream      zs;
+      gint          ret;
+      png_uint_32   r;
+      png_uint_32   band_first;
+      png_uint_32   band_end;
+
+      memset (&zs, 0, sizeof (zs));
+      if (inflateInit2 (&zs, -15) != Z_OK)
+        {
+          g_atomic_int_set (&job->failed, TRUE);
+          break;
+        }
+      zs.next_in   = (Bytef *) bands->idat + start;
+      zs.avail_in  = end - start;
+      zs.next_out  = filtered;
+      zs.avail_out = expected;
+      ret = inflate (&zs, Z_SYNC_FLUSH);
+      inflateEnd (&zs);
+
+      /* a band ends exactly where the next one starts */
+      if (zs.avail_out != 0 || zs.avail_in != 0 ||
+          ret != (b + 1 < bands->n_bands ? Z_OK : Z_STREAM_END))
+        {
+          g_atomic_int_set (&job->failed, TRUE);
+          break;
+        }
+
+      if (bands->verify)
+        job->adlers[b] = adler32 (adler32 (0, NULL, 0), filtered, expected);
+
+      for (r = 0; r < n; r++)
+        {
+          guchar *row    = filtered + r * stride;
+          guint   filter = row[0];
+
+          if (r == 0 && b != 0 &&
+              filter != PNG_FILTER_VALUE_NONE && filter != PNG_FILTER_VALUE_SUB)
+            break;
+
+          if (! png_unfilter_row (row + 1, r ? row + 1 - stride : NULL,
+                                  job->rowbytes, job->filter_bpp, filter))
+            break;
+        }
+
+      if (r < n)
+        {
+          g_atomic_int_set (&job->failed, TRUE);
+          break;
+        }
+
+      band_first = MAX (y0, (png_uint_32) job->region.y);
+      band_end   = MIN (y0 + n,
+                        (png_uint_32) (job->region.y + job->region.height));
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+      if (job->bit_depth == 16)
+        for (r = band_first - y0; r < band_end - y0; r++)
+          swap_bytes_16 (filtered + r * stride + 1, job->rowbytes);
+#endif
+
+      if (band_first < band_end)
+        {
+          GeglRectangle rect;
+
+          gegl_rectangle_set (&rect, job->region.x, band_first,
+                              job->region.width, band_end - band_first);
+          gegl_buffer_set (job->buffer, &rect, 0, job->format,
+                           filtered + (band_first - y0) * stride + 1 +
+                           (gsize) job->region.x * job->filter_bpp,
+                           stride);
+        }
+    }
+
+  g_free (filtered);
+}
+
+/* decodes the rows of @region from the bands, returns FALSE if the bands
+ * turn out to be unusable and the caller has to fall back to libpng.
+ */
+static gboolean
+bands_decode (const PngBands      *bands,
+              GeglBuffer          *buffer,
+              const Babl          *format,
+              const GeglRectangle *region,
+              png_uint_32          width,
+              png_uint_32          height,
+              gint                 bpp,
+              gint                 bit_depth)
+{
+  PngBandsJob job;
+  guint32     end_band;
+
+  if (! region->height)
+    return TRUE;
+
+  job.bands      = bands;
+  job.buffer     = buffer;
+  job.format     = format;
+  job.region     = *region;
+  job.height     = height;
+  job.rowbytes   = (gsize) width * bpp;
+  job.filter_bpp = bpp;
+  job.bit_depth  = bit_depth;
+  job.first_band = region->y / bands->band_rows;
+  job.adlers     = g_new0 (guint32, bands->n_bands);
+  job.failed     = FALSE;
+  end_band       = (region->y + region->height - 1) / bands->band_rows + 1;
+
+  gegl_parallel_distribute_range (end_band - job.first_band, 1,
+                                  bands_decode_range, &job);
+
+  /* verified loads only decode all the bands, see the caller */
+  if (bands->verify && ! job.failed)
+    {
+      guint32 adler = job.adlers[0];
+      guint32 b;
+
+      for (b = 1; b < bands->n_bands; b++)
+        {
+          png_uint_32 n = MIN (bands->band_rows, height - b * bands->band_rows);
+
+          adler = adler32_combine64 (adler, job.adlers[b],
+                                     (z_off64_t) (job.rowbytes + 1) * n);
+        }
+
+      if (adler != png_get_u32 (bands->idat + bands->idat_length - 4))
+        job.failed = TRUE;
+    }
+
+  g_free (job.adlers);
+
+  return ! job.failed;
+}
+
+/* palette images are read as indices and expanded through a table */
+typedef struct
+{
+  gint   channels;            /* 0 for images without palette */
+  guchar entries[256 * 4];
+} PngPalette;
+
+static void
+palette_init (PngPalette  *palette,
+              png_structp  load_png_ptr,
+              png_infop    load_info_ptr,
+              gboolean     has_alpha,
+              gdouble      exponent) // gamma correction, 1.0 for none
+{
+  png_colorp  colors = NULL;
+  png_bytep   alpha = NULL;
+  int         n_colors = 0;
+  int         n_alpha = 0;
+  guchar      gamma[256];
+  gint        i;
+
+  png_get_PLTE (load_png_ptr, load_info_ptr, &colors, &n_colors);
+  if (has_alpha)
+    png_get_tRNS (load_png_ptr, load_info_ptr, &alpha, &n_alpha, NULL);
+
+  /* the same 8 bit table libpng would build */
+  for (i = 0; i < 256; i++)
+    gamma[i] = i == 0 || i == 255 || exponent == 1.0 ?
+               i : floor (255.0 * pow (i / 255.0, exponent) + 0.5);
+
+  /* indices past the palette are black, as with png_set_palette_to_rgb */
+  memset (palette->entries, 0, sizeof (palette->entries));
+  palette->channels = has_alpha ? 4 : 3;
+
+  for (i = 0; i < 256; i++)
+    {
+      guchar *entry = palette->entries + i * 4;
+
+      if (i < n_colors)
+        {
+          entry[0] = gamma[colors[i].red];
+          entry[1] = gamma[colors[i].green];
+          entry[2] = gamma[colors[i].blue];
+        }
+      entry[3] = i < n_alpha ? alpha[i] : 0xff;
+    }
+}
+
+/* @dest may overlap the indices as long as it does not start before them */
+static void
+palette_expand (const PngPalette *palette,
+                guchar           *dest,
+                const guchar     *indices,
+                gsize             n_pixels)
+{
+  gsize i;
+
+  /* back to front, the pixels are larger than the indices */
+  if (palette->channels == 4)
+    for (i = n_pixels; i--;)
+      memcpy (dest + i * 4, palette->entries + indices[i] * 4, 4);
+  else
+    for (i = n_pixels; i--;)
+      memcpy (dest + i * 3, palette->entries + indices[i] * 4, 3);
+}
+
+/* sets up the transformations of libpng, returns the bit depth, bytes per
+ * pixel and number of passes of the rows it hands out
+ */
+static gboolean
+setup_transforms (png_structp   load_png_ptr,
+                  png_infop     load_info_ptr,
+                  const Babl  **format,
+                  gint         *ret_bit_depth,
+                  gint         *ret_bpp,
+                  gint         *number_of_passes,
+                  gboolean     *needs_transform,
+                  PngPalette   *palette)
+{
+  const Babl  *space = NULL;
+  png_uint_32  w;
+  png_uint_32  h;
+  int          bit_depth;
+  int          color_type;
+  int          interlace_type;
+  gint         bpp;
+
+  png_get_IHDR (load_png_ptr,
+                load_info_ptr,
+                &w, &h,
+                &bit_depth,
+                &color_type,
+                &interlace_type,
+                NULL, NULL);
+
+  *needs_transform  = FALSE;
+  *number_of_passes = 1;
+  palette->channels = 0;
+
+  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+    {
+      png_set_expand (load_png_ptr);
+      bit_depth = 8;
+      *needs_transform = TRUE;
+    }
+
+  if (png_get_valid (load_png_ptr, load_info_ptr, PNG_INFO_tRNS))
+    {
+      if (color_type != PNG_COLOR_TYPE_PALETTE)
+        png_set_tRNS_to_alpha (load_png_ptr);
+      color_type |= PNG_COLOR_MASK_ALPHA;
+      *needs_transform = TRUE;
+    }
+
+  switch (color_type)
+    {
+      case PNG_COLOR_TYPE_GRAY:
+        bpp = 1;
+        break;
+      case PNG_COLOR_TYPE_GRAY_ALPHA:
+        bpp = 2;
+        break;
+      case PNG_COLOR_TYPE_RGB:
+        bpp = 3;
+        break;
+      case PNG_COLOR_TYPE_RGB_ALPHA:
+        bpp = 4;
+        break;
+      case (PNG_COLOR_TYPE_PALETTE | PNG_COLOR_MASK_ALPHA):
+        bpp = 4;
+        break;
+      case PNG_COLOR_TYPE_PALETTE:
+        bpp = 3;
+        break;
+      default:
+        g_warning ("color type mismatch");
+        return FALSE;
+    }
+
+  /* the format from a query already carries the space */
+  if (*format)
+    {
+      space = babl_format_get_space (*format);
+      if (space == babl_space ("sRGB"))
+        space = NULL;
+    }
+  else
+    {
+      space = gegl_png_space (load_png_ptr, load_info_ptr);
+    }
+
+  if ((color_type & ~PNG_COLOR_MASK_ALPHA) == PNG_COLOR_TYPE_PALETTE)
+    {
+      /* one index per byte */
+      if (bit_depth < 8)
+        png_set_packing (load_png_ptr);
+      *needs_transform = TRUE;
+    }
+
+  if (bit_depth == 16)
+    bpp = bpp << 1;
+
+  if (!*format)
+    *format = get_babl_format(bit_depth, color_type, space);
+  /* the file may have been rewritten since the query */
+  else if (*format != get_babl_format (bit_depth, color_type, space))
+    png_error (load_png_ptr, "file changed since it was queried");
+
+  /* 16 bit rows are swapped a band at a time */
+
+  if (interlace_type == PNG_INTERLACE_ADAM7)
+    *number_of_passes = png_set_interlace_handling (load_png_ptr);
+
+  {
+  gdouble gamma    = 0.45455;
+  gdouble exponent = 1.0;
+
+  if (!space)
+  {
+  if (png_get_valid (load_png_ptr, load_info_ptr, PNG_INFO_gAMA))
+    png_get_gAMA (load_png_ptr, load_info_ptr, &gamma);
+
+  /* libpng leaves the samples alone for corrections this close to 1.0 */
+  if (fabs (1.0 / (gamma * 2.2) - 1.0) >= 0.05)
+    {
+      exponent = 1.0 / (gamma * 2.2);
+      *needs_transform = TRUE;
+    }
+  }
+
+  if ((color_type & ~PNG_COLOR_MASK_ALPHA) == PNG_COLOR_TYPE_PALETTE)
+    palette_init (palette, load_png_ptr, load_info_ptr,
+                  color_type & PNG_COLOR_MASK_ALPHA, exponent);
+  else if (!space)
+    png_set_gamma (load_png_ptr, 2.2, gamma);
+  }
+
+  png_read_update_info (load_png_ptr, load_info_ptr);
+
+  *ret_bit_depth = bit_depth;
+  *ret_bpp       = bpp;
+
+  return TRUE;
+}
+
+/* Reduced resolution decoding.  Interlaced images are decoded up to the
+ * last pass contributing to the level and sampled, other images are
+ * averaged over blocks of 2^N by 2^N pixels row by row.
+ */
+static void
+import_level (PngContext          *ctx,
+              GeglBuffer          *gegl_buffer,
+              const Babl          *format,
+              const PngPalette    *palette,
+              png_uint_32          w,
+              png_uint_32          h,
+              gint                 bpp,
+              gint                 bit_depth,
+              gint                 number_of_passes,
+              const GeglRectangle *roi, // in coordinates of @level
+              gint                 level,
+              gint                 store_level)
+{
+  GeglRectangle  region = {0, 0, ((w - 1) >> level) + 1,
+                                 ((h - 1) >> level) + 1};
+  GeglRectangle  rect;
+  gsize          rowstride   = (gsize) w * bpp;
+  gint           sample_size = bit_depth == 16 ? 2 : 1;
+  gint           channels    = bpp / sample_size;
+  gsize          out_rowstride;
+  gint           band_height;
+  guchar        *out;
+  guchar        *plane = NULL;
+  guchar        *line  = NULL;
+  guint64       *sums  = NULL;
+  png_uint_32    x0, x1;
+  gint           i;
+
+  if (roi)
+    gegl_rectangle_intersect (&region, &region, roi);
+  if (gegl_rectangle_is_empty (&region))
+    return;
+
+  x0 = region.x << level;
+  x1 = MIN (w, (png_uint_32) (region.x + region.width) << level);
+
+  g_object_get (gegl_buffer, "tile-height", &band_height, NULL);
+  band_height   = CLAMP (band_height, 1, region.height);
+  out_rowstride = (gsize) region.width * bpp;
+  out           = context_alloc0 (ctx, out_rowstride * band_height);
+  if (! out)
+    png_error (ctx->png, "out of memory");
+
+  if (number_of_passes > 1)
+    {
+      /* every 8th, 4th and 2nd row and column are complete after the
+       * first, third and fifth pass
+       */
+      gint        passes    = level >= 3 ? 1 : 7 - 2 * level;
+      png_bytep  *pass_rows = context_alloc0 (ctx, sizeof (png_bytep) * h);
+      gint        pass;
+
+      /* the full width of every row of the region */
+      plane = context_alloc0 (ctx, rowstride * region.height);
+      if (! pass_rows || ! plane)
+        png_error (ctx->png, "out of memory");
+
+      for (i = 0; i < region.height; i++)
+        pass_rows[(region.y + i) << level] = plane + i * rowstride;
+
+      for (pass = 0; pass < passes; pass++)
+        PNG_TRACE (PNG_STATS (ctx->png), PNG_PHASE_LIBPNG, 0,
+                   png_read_rows (ctx->png, pass_rows, NULL, h));
+
+      context_release (ctx, pass_rows);
+    }
+  else
+    {
+      png_uint_32 row;
+
+      line = context_alloc0 (ctx, rowstride);
+      sums = context_alloc0 (ctx, sizeof (guint64) * region.width * channels);
+      if (! line || ! sums)
+        png_error (ctx->png, "out of memory");
+
+      for (row = 0; row < (png_uint_32) region.y << level; row++)
+        PNG_TRACE (PNG_STATS (ctx->png), PNG_PHASE_LIBPNG, 0,
+                   png_read_row (ctx->png, NULL, NULL));
+    }
+
+  for (i = 0; i < region.height; i++)
+    {
+      guchar *dest = out + (i % band_height) * out_rowstride;
+      gint    x;
+
+      if (plane)
+        {
+          /* indices of palette images, expanded along with the row */
+          gint    src_bpp = palette->channels ? 1 : bpp;
+          guchar *src     = plane + i * rowstride;
+
+          for (x = 0; x < region.width; x++)
+            memcpy (dest + x * src_bpp,
+                    src + (gsize) ((region.x + x) << level) * src_bpp,
+                    src_bpp);
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+          if (bit_depth == 16)
+            swap_bytes_16 (dest, out_rowstride);
+#endif
+          if (palette->channels)
+            palette_expand (palette, dest, dest, region.width);
+        }
+      else
+        {
+          png_uint_32 y_first = (png_uint_32) (region.y + i) << level;
+          png_uint_32 y_end   = MIN (h, y_first + (1 << level));
+          png_uint_32 y;
+          png_uint_32 px;
+          gint        c;
+
+          memset (sums, 0, sizeof (guint64) * region.width * channels);
+
+          for (y = y_first; y < y_end; y++)
+            {
+              PNG_TRACE (PNG_STATS (ctx->png), PNG_PHASE_LIBPNG, 0,
+                         png_read_row (ctx->png, line, NULL));
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+              if (bit_depth == 16)
+                swap_bytes_16 (line + x0 * bpp, (x1 - x0) * bpp);
+#endif
+              if (palette->channels)
+                palette_expand (palette, line + x0 * bpp, line + x0, x1 - x0);
+
+              for (px = x0; px < x1; px++)
+                {
+                  guint64 *sum = sums + ((px - x0) >> level) * channels;
+
+                  if (sample_size == 2)
+                    for (c = 0; c < channels; c++)
+                      sum[c] += ((guint16 *) line)[px * channels + c];
+                  else
+                    for (c = 0; c < channels; c++)
+                      sum[c] += line[px * channels + c];
+                }
+            }
+
+          for (x = 0; x < region.width; x++)
+            {
+              png_uint_32 x_first = (png_uint_32) (region.x + x) << level;
+              png_uint_32 x_end   = MIN (x1, x_first + (1 << level));
+              guint64     count   = (guint64) (y_end - y_first) *
+                                    (x_end - x_first);
+
+              for (c = 0; c < channels; c++)
+                {
+                  guint64 mean = (sums[x * channels + c] + count / 2) / count;
+
+                  if (sample_size == 2)
+                    ((guint16 *) dest)[x * channels + c] = mean;
+                  else
+                    dest[x * channels + c] = mean;
+                }
+            }
+        }
+
+      if ((i + 1) % band_height == 0 || i + 1 == region.height)
+        {
+          gint n = i % band_height + 1;
+
+          gegl_rectangle_set (&rect, region.x, region.y + i + 1 - n,
+                              region.width, n);
+          PNG_TRACE (PNG_STATS (ctx->png), PNG_PHASE_BUFFER, 0,
+                     gegl_buffer_set (gegl_buffer, &rect, store_level,
+                                      format, out, out_rowstride));
+        }
+    }
+
+  context_release (ctx, plane);
+  context_release (ctx, line);
+  context_release (ctx, sums);
+  context_release (ctx, out);
+}
+
+static gint
+gegl_buffer_import_png (GeglBuffer  *gegl_buffer,
+                        PngReader   *reader,
+                        gint         dest_x,
+                        gint         dest_y,
+                        gint        *ret_width,
+                        gint        *ret_height,
+                        const Babl  *format, // can be NULL
+                        const GeglRectangle *roi, // can be NULL
+                        gint         level,
+                        gint         shrink, // levels to reduce by on top
+                        gboolean     trusted,
+                        GError **err)
+{
+  gint           width;
+  gint           bit_depth;
+  gint           bpp;
+  gint           number_of_passes=1;
+  png_uint_32    w;
+  png_uint_32    h;
+  PngContext    *ctx;
+  png_structp    load_png_ptr;
+  png_infop      load_info_ptr;
+  guchar        *pixels;
+  png_bytep     *rows;
+  gint           band_height = 64;
+  png_uint_32    n_rows;
+  gboolean       needs_transform = FALSE;
+  PngBands       bands;
+  PngPalette     palette;
+  unsigned   int i;
+
+  g_return_val_if_fail(reader, -1);
+
+  if (!check_valid_png_header(reader, err))
+    {
+      return -1;
+    }
+
+  ctx = context_new ("png-load", trusted, reader->limits);
+  if (!ctx)
+    {
+      return -1;
+    }
+  load_png_ptr  = ctx->png;
+  load_info_ptr = ctx->info;
+
+  if (setjmp (png_jmpbuf (load_png_ptr)))
+    {
+      return context_destroy (ctx, err);
+    }
+
+  png_set_read_fn(load_png_ptr, reader, read_fn);
+  skip_ancillary_chunks (load_png_ptr, format == NULL);
+
+#ifdef PNG_HANDLE_AS_UNKNOWN_SUPPORTED
+  if (reader->mapped)
+    png_set_keep_unknown_chunks (load_png_ptr, PNG_HANDLE_CHUNK_ALWAYS,
+                                 (png_const_bytep) PNG_BANDS_CHUNK, 1);
+#endif
 
   png_set_sig_bytes (load_png_ptr, 8); // we already read header
-  png_read_info (load_png_ptr, load_info_ptr);
+  PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_LIBPNG, 0,
+             png_read_info (load_png_ptr, load_info_ptr));
+
+  if (! setup_transforms (load_png_ptr, load_info_ptr, &format,
+                          &bit_depth, &bpp, &number_of_passes,
+                          &needs_transform, &palette))
+    {
+      context_destroy (ctx, err);
+      return -1;
+    }
+
+  png_get_IHDR (load_png_ptr, load_info_ptr, &w, &h,
+                NULL, NULL, NULL, NULL, NULL);
+  width = w;
+  if (ret_width)
+    *ret_width = w;
+  if (ret_height)
+    *ret_height = h;
+
+  g_object_get (gegl_buffer, "tile-height", &band_height, NULL);
+  limits_check (load_png_ptr, reader->limits, w, h, level + shrink, bpp,
+                babl_format_get_bytes_per_pixel (
+                  gegl_buffer_get_format (gegl_buffer)),
+                band_height, number_of_passes > 1);
+
+  if (level + shrink > 0)
+    {
+      import_level (ctx, gegl_buffer, format, &palette, w, h, bpp, bit_depth,
+                    number_of_passes, roi, level + shrink, level);
+      return context_destroy (ctx, err);
+    }
+
+  /* decode a band of rows matching the tile height at a time */
+  band_height = CLAMP (band_height, 1, (gint) h);
+
+  pixels = context_alloc0 (ctx, (gsize) width * bpp * band_height);
+  rows   = context_alloc0 (ctx, sizeof (png_bytep) * band_height);
+  if (! pixels || ! rows)
+    png_error (load_png_ptr, "out of memory");
+
+  for (i = 0; i < band_height; i++)
+    rows[i] = pixels + (gsize) i * width * bpp;
+
   {
-    int color_type;
-    int interlace_type;
+    GeglRectangle  rect;
+    GeglRectangle  region = {0, 0, width, h};
+    gsize          rowstride = (gsize) width * bpp;
+    guchar        *even_rows = NULL;
+    png_bytep     *tile_rows = NULL;
+    gint           tile_width = 0;
+    png_uint_32    first_row;
+    png_uint_32    end_row;
+    png_uint_32    even_base;
+    guint64        headroom = G_MAXUINT64;
+
+    /* only the rows and columns of the requested region are stored */
+    if (roi)
+      gegl_rectangle_intersect (&region, &region, roi);
+    first_row = region.y;
+    end_row   = region.y + region.height;
+    even_base = first_row & ~1;
+
+    /* what the memory budget leaves over */
+    if (reader->limits && reader->limits->max_memory)
+      {
+        guint64 used = limits_estimate (w, h, 0, bpp,
+                                        babl_format_get_bytes_per_pixel (
+                                          gegl_buffer_get_format (gegl_buffer)),
+                                        band_height, number_of_passes > 1);
 
-    png_get_IHDR (load_png_ptr,
-                  load_info_ptr,
-                  &w, &h,
-                  &bit_depth,
-                  &color_type,
-                  &interlace_type,
-                  NULL, NULL);
-    width = w;
-    if (ret_width)
-      *ret_width = w;
-    if (ret_height)
-      *ret_height = h;
-
-    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        headroom = reader->limits->max_memory > used ?
+                   reader->limits->max_memory - used : 0;
+      }
+
+    /* files saved in bands are decoded in parallel, bypassing libpng; the
+     * adler32 covers the whole stream, so untrusted files need every row
+     */
+    if (number_of_passes == 1 && ! needs_transform &&
+        (trusted || (first_row == 0 && end_row == h)) &&
+        bands_find (&bands, load_png_ptr, load_info_ptr, reader, h,
+                    ! trusted, headroom))
       {
-        png_set_expand (load_png_ptr);
-        bit_depth = 8;
+        gboolean done;
+
+        PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_BANDS, 0,
+                   done = bands_decode (&bands, gegl_buffer, format, &region,
+                                        w, h, bpp, bit_depth));
+        bands_clear (&bands);
+
+        if (done)
+          return context_destroy (ctx, err);
       }
 
-    if (png_get_valid (load_png_ptr, load_info_ptr, PNG_INFO_tRNS))
+    if (number_of_passes > 1 && end_row > first_row)
       {
-        png_set_tRNS_to_alpha (load_png_ptr);
-        color_type |= PNG_COLOR_MASK_ALPHA;
+        /* Adam7 only touches odd rows in the last pass, collect the even
+         * rows in a plane and store every band once, during the last pass
+         */
+        png_bytep *pass_rows = context_alloc0 (ctx, sizeof (png_bytep) * h);
+        gint       pass;
+
+        /* before any pixel data is read, a bogus header fails here */
+        even_rows = context_alloc0 (ctx, rowstride *
+                                         ((end_row - even_base + 1) / 2));
+        if (! pass_rows || ! even_rows)
+          png_error (load_png_ptr, "out of memory");
+
+        for (i = even_base; i < end_row; i += 2)
+          pass_rows[i] = even_rows + ((i - even_base) / 2) * rowstride;
+
+        for (pass = 0; pass < number_of_passes - 1; pass++)
+          PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_LIBPNG, 0,
+                     png_read_rows (load_png_ptr, pass_rows, NULL, h));
+
+        context_release (ctx, pass_rows);
       }
 
-    switch (color_type)
+    /* rows exactly as wide as a tile are decoded straight into the tiles */
+    g_object_get (gegl_buffer, "tile-width", &tile_width, NULL);
+    if (format == gegl_buffer_get_format (gegl_buffer) &&
+        region.x == 0 && region.width == width && width == tile_width)
+      tile_rows = context_alloc0 (ctx, sizeof (png_bytep) * band_height);
+
+    for (i = 0; i < end_row; i += n_rows)
       {
-        case PNG_COLOR_TYPE_GRAY:
-          bpp = 1;
-          break;
-        case PNG_COLOR_TYPE_GRAY_ALPHA:
-          bpp = 2;
-          break;
-        case PNG_COLOR_TYPE_RGB:
-          bpp = 3;
-          break;
-        case PNG_COLOR_TYPE_RGB_ALPHA:
-          bpp = 4;
-          break;
-        case (PNG_COLOR_TYPE_PALETTE | PNG_COLOR_MASK_ALPHA):
-          bpp = 4;
-          break;
-        case PNG_COLOR_TYPE_PALETTE:
-          bpp = 3;
-          break;
-        default:
-          g_warning ("color type mismatch");
-          png_destroy_read_struct (&load_png_ptr, &load_info_ptr, NULL);
-          return -1;
+        png_bytep  *band_rows = rows;
+        png_uint_32 band_first;
+        png_uint_32 band_end;
+
+        n_rows     = MIN (band_height, end_row - i);
+        band_first = MAX (i, first_row);
+        band_end   = i + n_rows;
+
+        if (tile_rows && band_first == i)
+          {
+            GeglBufferIterator *it;
+
+            gegl_rectangle_set (&rect, 0, i, width, n_rows);
+            it = gegl_buffer_iterator_new (gegl_buffer, &rect, 0, format,
+                                           GEGL_ACCESS_WRITE, GEGL_ABYSS_NONE,
+                                           1);
+            if (gegl_buffer_iterator_next (it))
+              {
+                if (gegl_rectangle_equal (&it->items[0].roi, &rect))
+                  {
+                    png_uint_32 row;
+
+                    for (row = 0; row < n_rows; row++)
+                      tile_rows[row] = (guchar *) it->items[0].data +
+                                       row * rowstride;
+                    band_rows     = tile_rows;
+                    ctx->iterator = it;
+                  }
+                else
+                  {
+                    /* whatever it stores is overwritten below */
+                    gegl_buffer_iterator_stop (it);
+                  }
+              }
+          }
+
+        if (even_rows)
+          {
+            png_uint_32 row;
+
+            for (row = band_first + (band_first & 1); row < band_end; row += 2)
+              memcpy (band_rows[row - i],
+                      even_rows + ((row - even_base) / 2) * rowstride,
+                      rowstride);
+          }
+
+        PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_LIBPNG, 0,
+                   png_read_rows (load_png_ptr, band_rows, NULL, n_rows));
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+        if (bit_depth == 16)
+          {
+            png_uint_32 row;
+
+            for (row = band_first; row < band_end; row++)
+              swap_bytes_16 (band_rows[row - i] + (gsize) region.x * bpp,
+                             (gsize) region.width * bpp);
+          }
+#endif
+
+        if (palette.channels)
+          {
+            png_uint_32 row;
+
+            for (row = band_first; row < band_end; row++)
+              palette_expand (&palette,
+                              band_rows[row - i] + (gsize) region.x * bpp,
+                              band_rows[row - i] + region.x, region.width);
+          }
+
+        if (band_rows == tile_rows)
+          {
+            /* releasing the tiles commits them */
+            PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_BUFFER, 0,
+                       gegl_buffer_iterator_stop (ctx->iterator));
+            ctx->iterator = NULL;
+          }
+        else if (band_first < band_end)
+          {
+            gegl_rectangle_set (&rect, region.x, band_first,
+                                region.width, band_end - band_first);
+            PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_BUFFER, 0,
+                       gegl_buffer_set (gegl_buffer, &rect, 0, format,
+                                        rows[band_first - i] +
+                                        (gsize) region.x * bpp,
+                                        rowstride));
+          }
       }
 
-    space = gegl_png_space (load_png_ptr, load_info_ptr);
+    context_release (ctx, even_rows);
+    context_release (ctx, tile_rows);
+
+    /* the trailing chunks are only of interest after a complete decode */
+    if (end_row == h)
+      PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_LIBPNG, 0,
+                 png_read_end (load_png_ptr, NULL));
+  }
+
+  return context_destroy (ctx, err);
+}
+
+
+
+#ifndef PNG_LOAD_BATCH
+
+/* Progressive loading of streams that are not mapped, through libpng's
+ * push decoder, storing every band of rows as soon as it is complete.
+ */
+typedef struct
+{
+  PngContext    *ctx;
+  GeglOperation *operation;
+  GeglBuffer    *buffer;
+  const Babl    *format;
+  const GeglRectangle *roi;
+  const PngLimits     *limits;
+  GeglRectangle  region;
+  png_uint_32    height;
+  gint           bpp;
+  gint           bit_depth;
+  gsize          rowstride;
+  gsize          png_rowbytes; /* of the rows libpng hands out */
+  PngPalette     palette;
+  gint           number_of_passes;
+  gint           pass;
+  guchar        *pixels;      /* a band of rows, or every row of the region
+                               * for interlaced images */
+  png_uint_32    band_height;
+  png_uint_32    band_first;
+  png_uint_32    band_end;    /* end of the rows decoded into the band */
+  gboolean       done;
+} PngProgressive;
+
+static void
+progressive_store (PngProgressive *load,
+                   png_uint_32     first,
+                   png_uint_32     end)
+{
+  GeglRectangle rect;
+  guchar       *pixels;
+  guchar       *expanded = NULL;
+
+  if (end <= first)
+    return;
+
+  pixels = load->pixels + (gsize) (first - load->band_first) * load->rowstride;
+
+  /* the passes to come still combine into the indices, expand a copy */
+  if (load->palette.channels && load->number_of_passes > 1)
+    {
+      png_uint_32 row;
+
+      expanded = g_try_malloc ((gsize) (end - first) * load->rowstride);
+      if (! expanded)
+        png_error (load->ctx->png, "out of memory");
+
+      for (row = 0; row < end - first; row++)
+        palette_expand (&load->palette,
+                        expanded + row * load->rowstride +
+                        (gsize) load->region.x * load->bpp,
+                        pixels + row * load->rowstride + load->region.x,
+                        load->region.width);
+      pixels = expanded;
+    }
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+  if (load->bit_depth == 16)
+    swap_bytes_16 (pixels, (gsize) (end - first) * load->rowstride);
+#endif
+
+  gegl_rectangle_set (&rect, load->region.x, first,
+                      load->region.width, end - first);
+  PNG_TRACE (PNG_STATS (load->ctx->png), PNG_PHASE_BUFFER, 0,
+             gegl_buffer_set (load->buffer, &rect, 0, load->format,
+                              pixels + (gsize) load->region.x * load->bpp,
+                              load->rowstride));
+  g_free (expanded);
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+  /* the passes still to come combine into the big endian rows */
+  if (load->bit_depth == 16 && load->number_of_passes > 1)
+    swap_bytes_16 (pixels, (gsize) (end - first) * load->rowstride);
+#endif
+}
+
+/* stores the rows decoded so far that were not stored yet */
+static void
+progressive_flush (PngProgressive *load)
+{
+  if (! load->pixels || load->done)
+    return;
+
+  if (load->number_of_passes > 1)
+    progressive_store (load, load->region.y,
+                       load->region.y + load->region.height);
+  else
+    progressive_store (load, load->band_first, load->band_end);
+
+  load->done = TRUE;
+}
+
+static void
+progressive_info_fn (png_structp png_ptr,
+                     png_infop   info_ptr)
+{
+  PngProgressive *load = png_get_progressive_ptr (png_ptr);
+  png_uint_32     w;
+  png_uint_32     h;
+  gboolean        needs_transform;
+
+  if (! setup_transforms (png_ptr, info_ptr, &load->format, &load->bit_depth,
+                          &load->bpp, &load->number_of_passes,
+                          &needs_transform, &load->palette))
+    png_error (png_ptr, "color type mismatch");
+
+  png_get_IHDR (png_ptr, info_ptr, &w, &h, NULL, NULL, NULL, NULL, NULL);
+  g_object_get (load->buffer, "tile-height", &load->band_height, NULL);
+  limits_check (png_ptr, load->limits, w, h, 0, load->bpp,
+                babl_format_get_bytes_per_pixel (
+                  gegl_buffer_get_format (load->buffer)),
+                load->band_height, load->number_of_passes > 1);
+
+  load->height       = h;
+  load->rowstride    = (gsize) w * load->bpp;
+  load->png_rowbytes = png_get_rowbytes (png_ptr, info_ptr);
+
+  gegl_rectangle_set (&load->region, 0, 0, w, h);
+  if (load->roi)
+    gegl_rectangle_intersect (&load->region, &load->region, load->roi);
+  load->band_first = load->region.y;
+
+  if (gegl_rectangle_is_empty (&load->region))
+    {
+      load->done = TRUE;
+      return;
+    }
+
+  if (load->number_of_passes > 1)
+    load->band_height = load->region.height;
+  load->band_height = CLAMP (load->band_height, 1, load->region.height);
+
+  /* all of the region for interlaced images, before any pixel data */
+  load->pixels = context_alloc0 (load->ctx,
+                                 load->rowstride * load->band_height);
+  if (! load->pixels)
+    png_error (png_ptr, "out of memory");
+}
+
+static void
+progressive_row_fn (png_structp png_ptr,
+                    png_bytep   new_row,
+                    png_uint_32 row,
+                    int         pass)
+{
+  PngProgressive *load = png_get_progressive_ptr (png_ptr);
+  png_uint_32     first_row = load->region.y;
+  png_uint_32     end_row   = load->region.y + load->region.height;
+
+  if (load->done)
+    return;
+
+  if (load->number_of_passes > 1)
+    {
+      /* store the region when a pass is complete */
+      if (pass != load->pass)
+        {
+          progressive_store (load, first_row, end_row);
+          gegl_operation_progress (load->operation,
+                                   (gdouble) pass / load->number_of_passes,
+                                   "");
+          load->pass = pass;
+        }
+
+      if (row >= first_row && row < end_row)
+        png_progressive_combine_row (png_ptr,
+                                     load->pixels + (gsize) (row - first_row) *
+                                                    load->rowstride,
+                                     new_row);
+
+      if (pass == load->number_of_passes - 1 && row + 1 >= end_row)
+        progressive_flush (load);
+      return;
+    }
+
+  if (row < first_row || new_row == NULL)
+    return;
+
+  {
+    guchar *dest = load->pixels +
+                   (gsize) (row - load->band_first) * load->rowstride;
+
+    memcpy (dest, new_row, load->png_rowbytes);
+    if (load->palette.channels)
+      palette_expand (&load->palette,
+                      dest + (gsize) load->region.x * load->bpp,
+                      dest + load->region.x, load->region.width);
+  }
+  load->band_end = row + 1;
+
+  if (row + 1 == end_row || row + 1 - load->band_first == load->band_height)
+    {
+      progressive_store (load, load->band_first, row + 1);
+      gegl_operation_progress (load->operation,
+                               (gdouble) (row + 1) / load->height, "");
+      load->band_first = row + 1;
+      load->done       = row + 1 == end_row;
+    }
+}
+
+static void
+progressive_end_fn (png_structp png_ptr,
+                    png_infop   info_ptr)
+{
+  PngProgressive *load = png_get_progressive_ptr (png_ptr);
+
+  progressive_flush (load);
+  load->done = TRUE;
+}
+
+static gint
+gegl_buffer_import_png_progressive (GeglOperation       *operation,
+                                    GeglBuffer          *gegl_buffer,
+                                    PngReader           *reader,
+                                    const Babl          *format, // can be NULL
+                                    const GeglRectangle *roi, // can be NULL
+                                    gboolean             trusted,
+                                    GError             **err)
+{
+  PngContext     *ctx;
+  png_structp     load_png_ptr;
+  png_infop       load_info_ptr;
+  PngProgressive  load;
+
+  g_return_val_if_fail (reader && reader->stream, -1);
+
+  if (!check_valid_png_header(reader, err))
+    {
+      return -1;
+    }
+
+  ctx = context_new ("png-load-progressive", trusted, reader->limits);
+  if (!ctx)
+    {
+      return -1;
+    }
+  load_png_ptr  = ctx->png;
+  load_info_ptr = ctx->info;
+
+  memset (&load, 0, sizeof (load));
+  load.ctx       = ctx;
+  load.operation = operation;
+  load.buffer    = gegl_buffer;
+  load.format    = format;
+  load.roi       = roi;
+  load.limits    = reader->limits;
+
+  if (setjmp (png_jmpbuf (load_png_ptr)))
+    {
+      return context_destroy (ctx, err);
+    }
+
+  skip_ancillary_chunks (load_png_ptr, format == NULL);
+  png_set_progressive_read_fn (load_png_ptr, &load, progressive_info_fn,
+                               progressive_row_fn, progressive_end_fn);
+
+  /* the push decoder needs the signature */
+  {
+    static const png_byte signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+    png_process_data (load_png_ptr, load_info_ptr,
+                      (png_bytep) signature, sizeof (signature));
+  }
+
+  /* the reader may already hold more than the header */
+  if (reader->offset < reader->length)
+    PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_LIBPNG, 0,
+               png_process_data (load_png_ptr, load_info_ptr,
+                                 (png_bytep) reader->data + reader->offset,
+                                 reader->length - reader->offset));
+
+  while (! load.done)
+    {
+      gssize got;
+
+      PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_IO, MAX (got, 0),
+                 got = reader_fill (reader, err));
+
+      if (got <= 0)
+        {
+          /* keep what arrived of a truncated stream */
+          progressive_flush (&load);
+          if (got == 0)
+            g_set_error (err, error_quark (), LOAD_PNG_TOO_SHORT,
+                         "unexpected end of file");
+          context_destroy (ctx, NULL);
+          return -1;
+        }
+
+      PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_LIBPNG, 0,
+                 png_process_data (load_png_ptr, load_info_ptr,
+                                   reader->buffer, got));
+      reader->offset = reader->length;
+    }
+
+  return context_destroy (ctx, err);
+}
+
+#endif
+
+/* Animated pngs.  Frames are found in an index of the chunks of the file,
+ * every frame is turned into a png of its own, the header chunks of the
+ * file with the size of the frame and its fdAT chunks renamed to IDAT, and
+ * composited onto a canvas.  Seeking starts at the latest keyframe, or
+ * continues from the frame shown if that is closer.
+ */
+typedef struct
+{
+  guint32   x;
+  guint32   y;
+  guint32   width;
+  guint32   height;
+  guint8    dispose_op;
+  guint8    blend_op;
+  gsize     data_start;  /* of the first IDAT or fdAT chunk of the frame */
+  gsize     data_end;    /* and the end of its last one */
+  gboolean  keyframe;
+} PngFrame;
+
+typedef struct
+{
+  GBytes     *contents;
+  const Babl *file_format;
+  const Babl *format;      /* R'G'B'A float, of the canvas */
+  guint32     width;
+  guint32     height;
+  gsize       header_end;  /* the chunks ahead of the image data */
+  GArray     *frames;
+  gfloat     *canvas;      /* the frame shown */
+  guint       shown;       /* index of that frame plus one, 0 for none */
+  gfloat     *saved;       /* what the frame shown covered, for disposal */
+  PngLimits   limits;      /* of the frame decodes */
+} PngAnimation;
+
+static void
+animation_free (PngAnimation *anim)
+{
+  g_bytes_unref (anim->contents);
+  g_array_free (anim->frames, TRUE);
+  g_free (anim->canvas);
+  g_free (anim->saved);
+  g_free (anim);
+}
+
+static gboolean
+animation_covers (const PngAnimation *anim,
+                  const PngFrame     *frame)
+{
+  return frame->x == 0 && frame->y == 0 &&
+         frame->width == anim->width && frame->height == anim->height;
+}
 
-    if (color_type == PNG_COLOR_TYPE_PALETTE)
-      png_set_palette_to_rgb (load_png_ptr);
+static PngAnimation *
+animation_new (GBytes          *contents,
+               const Babl      *file_format,
+               const PngLimits *limits, // can be NULL
+               GError         **err)
+{
+  PngAnimation *anim;
+  PngFrame     *frame = NULL;
+  gsize         length;
+  const guchar *data = g_bytes_get_data (contents, &length);
+  gsize         pos  = 8;
+  guint         i;
+
+  if (length < 8 + 25 || png_get_u32 (data + 8) != 13 ||
+      memcmp (data + 12, "IHDR", 4))
+    {
+      g_set_error (err, error_quark (), LOAD_PNG_FAILED, "not a png file");
+      return NULL;
+    }
 
-    if (bit_depth == 16)
-      bpp = bpp << 1;
+  anim = g_new0 (PngAnimation, 1);
+  anim->contents    = g_bytes_ref (contents);
+  anim->file_format = file_format;
+  anim->format      = babl_format_with_space ("R'G'B'A float",
+                        babl_format_get_space (file_format));
+  anim->frames      = g_array_new (FALSE, TRUE, sizeof (PngFrame));
+  anim->width    = png_get_u32 (data + 16);
+  anim->height   = png_get_u32 (data + 20);
+  if (limits)
+    anim->limits = *limits;
+
+  while (pos + 12 <= length)
+    {
+      guint32       chunk_length = png_get_u32 (data + pos);
+      const guchar *type         = data + pos + 4;
+      const guchar *payload      = data + pos + 8;
+      gsize         end;
+
+      if (chunk_length > length - pos - 12)
+        break;
+      end = pos + 12 + chunk_length;
+
+      if (! memcmp (type, "fcTL", 4))
+        {
+          PngFrame next = { 0, };
+
+          if (chunk_length != 26 || (frame && ! frame->data_start))
+            goto corrupt;
+
+          next.width      = png_get_u32 (payload + 4);
+          next.height     = png_get_u32 (payload + 8);
+          next.x          = png_get_u32 (payload + 12);
+          next.y          = png_get_u32 (payload + 16);
+          next.dispose_op = payload[24];
+          next.blend_op   = payload[25];
+
+          if (next.width == 0 || next.height == 0 ||
+              next.x > anim->width || next.width > anim->width - next.x ||
+              next.y > anim->height || next.height > anim->height - next.y ||
+              next.dispose_op > APNG_DISPOSE_OP_PREVIOUS ||
+              next.blend_op > APNG_BLEND_OP_OVER)
+            goto corrupt;
+
+          g_array_append_val (anim->frames, next);
+          frame = &g_array_index (anim->frames, PngFrame,
+                                  anim->frames->len - 1);
+        }
+      else if (! memcmp (type, "IDAT", 4))
+        {
+          if (! anim->header_end)
+            anim->header_end = pos;
+
+          /* the default image is the first frame if an fcTL precedes it */
+          if (frame)
+            {
+              if (anim->frames->len != 1)
+                goto corrupt;
+              if (! frame->data_start)
+                frame->data_start = pos;
+              frame->data_end = end;
+            }
+        }
+      else if (! memcmp (type, "fdAT", 4))
+        {
+          if (! frame || ! anim->header_end || chunk_length < 4)
+            goto corrupt;
+          if (! frame->data_start)
+            frame->data_start = pos;
+          frame->data_end = end;
+        }
+      else if (! memcmp (type, "IEND", 4))
+        {
+          break;
+        }
+      pos = end;
+    }
+
+  if (anim->frames->len == 0)
+    {
+      g_set_error (err, error_quark (), LOAD_PNG_FAILED,
+                   "not an animated png file");
+      animation_free (anim);
+      return NULL;
+    }
+  if (! frame->data_start)
+    goto corrupt;
 
-    if (!format)
-      format = get_babl_format(bit_depth, color_type, space);
+  for (i = 0; i < anim->frames->len; i++)
+    {
+      PngFrame *f = &g_array_index (anim->frames, PngFrame, i);
+      PngFrame *prev = i ? f - 1 : NULL;
+
+      /* nothing is left to return to ahead of the first frame */
+      if (i == 0 && f->dispose_op == APNG_DISPOSE_OP_PREVIOUS)
+        f->dispose_op = APNG_DISPOSE_OP_BACKGROUND;
+
+      f->keyframe = i == 0 ||
+                    (animation_covers (anim, f) &&
+                     f->blend_op == APNG_BLEND_OP_SOURCE) ||
+                    (animation_covers (anim, prev) &&
+                     prev->dispose_op == APNG_DISPOSE_OP_BACKGROUND);
+    }
+
+  /* the canvas can not be reduced, frames are composited at full size */
+  if (anim->limits.max_memory &&
+      (guint64) anim->width * anim->height * 4 * sizeof (gfloat) >
+      anim->limits.max_memory)
+    {
+      g_set_error (err, error_quark (), LOAD_PNG_FAILED,
+                   "animation of %ux%u needs more memory than allowed",
+                   anim->width, anim->height);
+      animation_free (anim);
+      return NULL;
+    }
+
+  anim->canvas = g_try_new0 (gfloat, (gsize) anim->width * anim->height * 4);
+  if (! anim->canvas)
+    {
+      g_set_error (err, error_quark (), LOAD_PNG_FAILED,
+                   "animation of %ux%u too large",
+                   anim->width, anim->height);
+      animation_free (anim);
+      return NULL;
+    }
+
+  return anim;
+
+corrupt:
+  g_set_error (err, error_quark (), LOAD_PNG_FAILED,
+               "corrupted animation chunks");
+  animation_free (anim);
+  return NULL;
+}
+
+static void
+animation_append_chunk (GByteArray   *png,
+                        const gchar  *type,
+                        const guchar *data,
+                        guint32       length)
+{
+  guchar  header[8];
+  guchar  crc[4];
+
+  png_save_uint_32 (header, length);
+  memcpy (header + 4, type, 4);
+  png_save_uint_32 (crc, crc32 (crc32 (0, header + 4, 4), data, length));
+
+  g_byte_array_append (png, header, 8);
+  g_byte_array_append (png, data, length);
+  g_byte_array_append (png, crc, 4);
+}
+
+/* decodes @frame into @pixels, in the format of the canvas */
+static gboolean
+animation_decode (const PngAnimation *anim,
+                  const PngFrame     *frame,
+                  gfloat             *pixels,
+                  gboolean            trusted,
+                  GError            **err)
+{
+  GeglRectangle  rect = { 0, 0, frame->width, frame->height };
+  const guchar  *data = g_bytes_get_data (anim->contents, NULL);
+  GByteArray    *png  = g_byte_array_new ();
+  GeglBuffer    *buffer;
+  PngReader      reader;
+  guchar         ihdr[13];
+  gsize          pos;
+  gint           problem;
+
+  g_byte_array_append (png, data, 8);
+
+  memcpy (ihdr, data + 16, 13);
+  png_save_uint_32 (ihdr, frame->width);
+  png_save_uint_32 (ihdr + 4, frame->height);
+  animation_append_chunk (png, "IHDR", ihdr, 13);
+
+  for (pos = 8 + 25; pos < anim->header_end; )
+    {
+      guint32 chunk_length = png_get_u32 (data + pos);
+
+      if (memcmp (data + pos + 4, "acTL", 4) &&
+          memcmp (data + pos + 4, "fcTL", 4) &&
+          memcmp (data + pos + 4, PNG_BANDS_CHUNK, 4))
+        g_byte_array_append (png, data + pos, chunk_length + 12);
+      pos += (gsize) chunk_length + 12;
+    }
+
+  for (pos = frame->data_start; pos < frame->data_end; )
+    {
+      guint32 chunk_length = png_get_u32 (data + pos);
+
+      if (! memcmp (data + pos + 4, "IDAT", 4))
+        {
+          g_byte_array_append (png, data + pos, chunk_length + 12);
+        }
+      else if (! memcmp (data + pos + 4, "fdAT", 4))
+        {
+          /* libpng checks the CRC of the IDAT we turn it into */
+          if (! trusted &&
+              crc32 (0, data + pos + 4, chunk_length + 4) !=
+              png_get_u32 (data + pos + 8 + chunk_length))
+            {
+              g_set_error (err, error_quark (), LOAD_PNG_FAILED,
+                           "fdAT: CRC error");
+              g_byte_array_free (png, TRUE);
+              return FALSE;
+            }
+          /* minus its sequence number */
+          animation_append_chunk (png, "IDAT", data + pos + 12,
+                                  chunk_length - 4);
+        }
+      pos += (gsize) chunk_length + 12;
+    }
+
+  animation_append_chunk (png, "IEND", (const guchar *) "", 0);
+
+  memset (&reader, 0, sizeof (PngReader));
+  reader.data   = png->data;
+  reader.length = png->len;
+  reader.limits = &anim->limits;
+
+  buffer  = gegl_buffer_new (&rect, anim->format);
+  problem = gegl_buffer_import_png (buffer, &reader, 0, 0, NULL, NULL,
+                                    anim->file_format, NULL, 0, 0, trusted,
+                                    err);
+  if (! problem)
+    gegl_buffer_get (buffer, &rect, 1.0, anim->format, pixels,
+                     GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+  g_object_unref (buffer);
+  g_byte_array_free (png, TRUE);
+
+  return ! problem;
+}
+
+static void
+animation_dispose (PngAnimation *anim,
+                   guint         index)
+{
+  const PngFrame *frame = &g_array_index (anim->frames, PngFrame, index);
+  gsize           rowbytes = (gsize) frame->width * 4 * sizeof (gfloat);
+  guint32         y;
+
+  if (frame->dispose_op == APNG_DISPOSE_OP_NONE)
+    return;
+
+  for (y = 0; y < frame->height; y++)
+    {
+      gfloat *row = anim->canvas +
+                    ((gsize) (frame->y + y) * anim->width + frame->x) * 4;
 
-#if BYTE_ORDER == LITTLE_ENDIAN
-    if (bit_depth == 16)
-      png_set_swap (load_png_ptr);
-#endif
+      if (frame->dispose_op == APNG_DISPOSE_OP_BACKGROUND)
+        memset (row, 0, rowbytes);
+      else
+        memcpy (row, anim->saved + (gsize) y * frame->width * 4, rowbytes);
+    }
+}
 
-    if (interlace_type == PNG_INTERLACE_ADAM7)
-      number_of_passes = png_set_interlace_handling (load_png_ptr);
+static gboolean
+animation_compose (PngAnimation *anim,
+                   guint         index,
+                   gboolean      trusted,
+                   GError      **err)
+{
+  const PngFrame *frame = &g_array_index (anim->frames, PngFrame, index);
+  gsize           n_pixels = (gsize) frame->width * frame->height;
+  gfloat         *pixels;
+  guint32         x, y;
 
-    if (!space)
+  pixels = g_try_new (gfloat, n_pixels * 4);
+  if (! pixels)
     {
-    if (png_get_valid (load_png_ptr, load_info_ptr, PNG_INFO_gAMA))
-      {
-        gdouble gamma;
-        png_get_gAMA (load_png_ptr, load_info_ptr, &gamma);
-        png_set_gamma (load_png_ptr, 2.2, gamma);
-      }
-    else
-      {
-        png_set_gamma (load_png_ptr, 2.2, 0.45455);
-      }
+      g_set_error (err, error_quark (), LOAD_PNG_FAILED,
+                   "frame %u too large", index);
+      return FALSE;
     }
 
-    png_read_update_info (load_png_ptr, load_info_ptr);
-  }
+  if (! animation_decode (anim, frame, pixels, trusted, err))
+    {
+      g_free (pixels);
+      return FALSE;
+    }
 
-  pixels = g_malloc0 (width*bpp);
+  if (frame->dispose_op == APNG_DISPOSE_OP_PREVIOUS)
+    {
+      g_free (anim->saved);
+      anim->saved = g_try_new (gfloat, n_pixels * 4);
+      if (! anim->saved)
+        {
+          g_set_error (err, error_quark (), LOAD_PNG_FAILED,
+                       "frame %u too large", index);
+          g_free (pixels);
+          return FALSE;
+        }
+    }
 
-  {
-    gint           pass;
-    GeglRectangle  rect;
+  for (y = 0; y < frame->height; y++)
+    {
+      gfloat       *dst = anim->canvas +
+                          ((gsize) (frame->y + y) * anim->width + frame->x) * 4;
+      const gfloat *src = pixels + (gsize) y * frame->width * 4;
+
+      if (frame->dispose_op == APNG_DISPOSE_OP_PREVIOUS)
+        memcpy (anim->saved + (gsize) y * frame->width * 4, dst,
+                frame->width * 4 * sizeof (gfloat));
+
+      if (frame->blend_op == APNG_BLEND_OP_SOURCE)
+        {
+          memcpy (dst, src, frame->width * 4 * sizeof (gfloat));
+          continue;
+        }
+
+      /* OVER, on the samples as they are stored, like players do */
+      for (x = 0; x < frame->width; x++, dst += 4, src += 4)
+        {
+          gfloat alpha = src[3];
+          gfloat below = dst[3] * (1.0f - alpha);
+          gint   c;
+
+          if (alpha >= 1.0f)
+            {
+              memcpy (dst, src, 4 * sizeof (gfloat));
+            }
+          else if (alpha > 0.0f)
+            {
+              for (c = 0; c < 3; c++)
+                dst[c] = (src[c] * alpha + dst[c] * below) / (alpha + below);
+              dst[3] = alpha + below;
+            }
+        }
+    }
 
-    for (pass=0; pass<number_of_passes; pass++)
-      {
-        for(i=0; i<h; i++)
-          {
-            gegl_rectangle_set (&rect, 0, i, width, 1);
+  g_free (pixels);
+  return TRUE;
+}
 
-            if (pass != 0)
-              gegl_buffer_get (gegl_buffer, &rect, 1.0, format, pixels, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+/* leaves frame @index on the canvas of @anim */
+static gboolean
+animation_seek (PngAnimation *anim,
+                guint         index,
+                gboolean      trusted,
+                GCancellable *cancellable,
+                GError      **err)
+{
+  guint start;
+  guint i;
 
-            png_read_rows (load_png_ptr, &pixels, NULL, 1);
-            gegl_buffer_set (gegl_buffer, &rect, 0, format, pixels,
-                             GEGL_AUTO_ROWSTRIDE);
-          }
-      }
-  }
+  if (index >= anim->frames->len)
+    {
+      g_set_error (err, error_quark (), LOAD_PNG_FAILED,
+                   "no frame %u, the animation has %u", index,
+                   anim->frames->len);
+      return FALSE;
+    }
+  if (anim->shown == index + 1)
+    return TRUE;
 
+  for (start = index;
+       ! g_array_index (anim->frames, PngFrame, start).keyframe;
+       start--);
 
-  png_read_end (load_png_ptr, NULL);
-  png_destroy_read_struct (&load_png_ptr, &load_info_ptr, NULL);
+  if (anim->shown > start && anim->shown <= index)
+    {
+      animation_dispose (anim, anim->shown - 1);
+      start = anim->shown;
+    }
+  else
+    {
+      memset (anim->canvas, 0,
+              (gsize) anim->width * anim->height * 4 * sizeof (gfloat));
+    }
 
-  g_free (pixels);
+  anim->shown = 0;
+  for (i = start; i <= index; i++)
+    {
+      if (i > start)
+        animation_dispose (anim, i - 1);
+      if (g_cancellable_set_error_if_cancelled (cancellable, err) ||
+          ! animation_compose (anim, i, trusted, err))
+        return FALSE;
+    }
+  anim->shown = index + 1;
 
-  return 0;
+  return TRUE;
 }
 
+/* the format loads of a file in @file_format are stored in */
+static const Babl *
+output_format (const Babl *file_format,
+               const Babl *format, // can be NULL
+               gboolean    frame)
+{
+  if (format)
+    return babl_format_with_space (babl_format_get_encoding (format),
+                                   babl_format_get_space (file_format));
+  if (frame)
+    return babl_format_with_space (
+             babl_format_get_bytes_per_pixel (file_format) /
+             babl_format_get_n_components (file_format) == 2 ?
+             "R'G'B'A u16" : "R'G'B'A u8",
+             babl_format_get_space (file_format));
+  return file_format;
+}
 
-
-static gint query_png (GInputStream *stream,
+static gint query_png (PngReader    *reader,
                        gint        *width,
                        gint        *height,
                        const Babl  **format,
+                       guint       *n_frames,
+                       gboolean    *default_is_frame,
+                       gint        *shrink,
+                       const Babl  *requested, // can be NULL
+                       gboolean    trusted,
                        GError **err)
 {
   png_uint_32   w;
   png_uint_32   h;
+  PngContext   *ctx;
   png_structp   load_png_ptr;
   png_infop     load_info_ptr;
   const Babl *  space = NULL; // null means sRGB
 
-  png_bytep  *row_p = NULL;
-  g_return_val_if_fail(stream, -1);
-
-  if (!check_valid_png_header(stream, err))
-    {
-      return -1;
-    }
+  g_return_val_if_fail(reader, -1);
 
-  load_png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, error_fn, NULL);
-  if (!load_png_ptr)
+  if (!check_valid_png_header(reader, err))
     {
       return -1;
     }
 
-  load_info_ptr = png_create_info_struct (load_png_ptr);
-  if (!load_info_ptr)
+  ctx = context_new ("png-query", trusted, reader->limits);
+  if (!ctx)
     {
-      png_destroy_read_struct (&load_png_ptr, &load_info_ptr, NULL);
       return -1;
     }
-  png_set_benign_errors (load_png_ptr, TRUE);
-  png_set_option (load_png_ptr, PNG_SKIP_sRGB_CHECK_PROFILE, PNG_OPTION_ON);
-
+  load_png_ptr  = ctx->png;
+  load_info_ptr = ctx->info;
 
   if (setjmp (png_jmpbuf (load_png_ptr)))
     {
-     png_destroy_read_struct (&load_png_ptr, &load_info_ptr, NULL);
-     g_free (row_p);
-      return -1;
+      return context_destroy (ctx, err);
     }
 
-  png_set_read_fn(load_png_ptr, stream, read_fn);
+  png_set_read_fn(load_png_ptr, reader, read_fn);
+  skip_ancillary_chunks (load_png_ptr, TRUE);
+#ifdef PNG_HANDLE_AS_UNKNOWN_SUPPORTED
+  png_set_keep_unknown_chunks (load_png_ptr, PNG_HANDLE_CHUNK_ALWAYS,
+                               (png_const_bytep) "acTL\0fcTL", 2);
+#endif
   png_set_sig_bytes (load_png_ptr, 8); // we already read header
-  png_read_info (load_png_ptr, load_info_ptr);
+  PNG_TRACE (PNG_STATS (load_png_ptr), PNG_PHASE_LIBPNG, 0,
+             png_read_info (load_png_ptr, load_info_ptr));
+
+  *n_frames         = 0;
+  *default_is_frame = FALSE;
+#ifdef PNG_STORE_UNKNOWN_CHUNKS_SUPPORTED
+  {
+    png_unknown_chunkp unknowns = NULL;
+    gint               n_unknowns;
+    gint               i;
+
+    /* an fcTL ahead of the image data makes the default image a frame */
+    n_unknowns = png_get_unknown_chunks (load_png_ptr, load_info_ptr,
+                                         &unknowns);
+    for (i = 0; i < n_unknowns; i++)
+      {
+        if (! memcmp (unknowns[i].name, "acTL", 4) && unknowns[i].size == 8)
+          *n_frames = png_get_u32 (unknowns[i].data);
+        else if (! memcmp (unknowns[i].name, "fcTL", 4))
+          *default_is_frame = TRUE;
+      }
+  }
+#endif
   {
     int bit_depth;
     int color_type;
+    int interlace_type;
+    const PngLimits *limits = reader->limits;
     const Babl *f;
 
     png_get_IHDR (load_png_ptr,
@@ -452,10 +2872,14 @@ static gint query_png (GInputStream *stream,
                   &w, &h,
                   &bit_depth,
                   &color_type,
-                  NULL, NULL, NULL);
+                  &interlace_type, NULL, NULL);
     *width = w;
     *height = h;
 
+    if (limits && limits->max_pixels &&
+        (guint64) w * h > limits->max_pixels)
+      png_error (load_png_ptr, "image has more pixels than allowed");
+
     if (png_get_valid (load_png_ptr, load_info_ptr, PNG_INFO_tRNS))
       color_type |= PNG_COLOR_MASK_ALPHA;
 
@@ -464,47 +2888,333 @@ static gint query_png (GInputStream *stream,
     f = get_babl_format(bit_depth, color_type, space);
     if (!f)
       {
-        png_destroy_read_struct (&load_png_ptr, &load_info_ptr, NULL);
+        context_destroy (ctx, err);
         return -1;
       }
     *format = f;
 
+    if (limits && limits->max_memory)
+      {
+        gint band_height = 64;
+
+        g_object_get (gegl_config (), "tile-height", &band_height, NULL);
+        *shrink = limits_shrink (limits->max_memory, w, h,
+                                 babl_format_get_bytes_per_pixel (f),
+                                 babl_format_get_bytes_per_pixel (
+                                   output_format (f, requested, FALSE)),
+                                 band_height,
+                                 interlace_type != PNG_INTERLACE_NONE);
+      }
+    else
+      {
+        *shrink = 0;
+      }
+    if (*shrink < 0)
+      png_error (load_png_ptr, "image needs more memory than allowed");
+
   }
-  png_destroy_read_struct (&load_png_ptr, &load_info_ptr, NULL);
-  return 0;
+  return context_destroy (ctx, err);
+}
+
+/* from the units of the properties: megabytes and kilobytes */
+static void
+limits_init (PngLimits *limits,
+             gint       max_pixels,
+             gint       max_memory,
+             gint       max_chunk_size)
+{
+  limits->max_pixels = max_pixels;
+  limits->max_memory = (guint64) max_memory << 20;
+  limits->max_chunk  = (gsize) max_chunk_size << 10;
+}
+
+#ifndef PNG_LOAD_BATCH
+
+/* Header of the file the properties reference, queried once under the
+ * lock of the op and kept until a property changes or the file is
+ * rewritten.
+ */
+typedef struct
+{
+  GMutex      mutex;
+  gchar      *path;
+  gchar      *uri;
+  guint64     mtime;     /* in microseconds, with the size telling a */
+  guint64     size;      /* rewritten file from the queried one */
+  gboolean    restamp;   /* stat the file again on the next query */
+  PngLimits   limits;
+  const Babl *requested; /* format property, which the budget depends on */
+  gboolean    trusted;
+  gboolean    queried;
+  gint        status;
+  gint        width;
+  gint        height;
+  const Babl *format;
+  guint       n_frames;  /* 0 unless animated */
+  gboolean    default_is_frame;
+  gint        shrink;    /* mip levels to reduce the image by */
+  PngAnimation *animation;
+} Priv;
+
+/* the modification time and size of the file, 0 if it has none */
+static void
+file_stamp (GeglProperties *o,
+            guint64        *mtime,
+            guint64        *size)
+{
+  GFile     *file = NULL;
+  GFileInfo *info;
+
+  *mtime = 0;
+  *size  = 0;
+
+  if (o->uri && o->uri[0])
+    file = g_file_new_for_uri (o->uri);
+  else if (o->path && o->path[0] && strcmp (o->path, "-"))
+    file = g_file_new_for_path (o->path);
+  if (! file)
+    return;
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC ","
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE, NULL, NULL);
+  if (info)
+    {
+      *mtime = g_file_info_get_attribute_uint64 (info,
+                                     G_FILE_ATTRIBUTE_TIME_MODIFIED) *
+               G_USEC_PER_SEC +
+               g_file_info_get_attribute_uint32 (info,
+                                     G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+      *size  = g_file_info_get_attribute_uint64 (info,
+                                     G_FILE_ATTRIBUTE_STANDARD_SIZE);
+      g_object_unref (info);
+    }
+  g_object_unref (file);
+}
+
+static void
+cleanup (GeglOperation *operation)
+{
+  GeglProperties *o = GEGL_PROPERTIES (operation);
+  Priv *p = (Priv*) o->user_data;
+
+  if (p != NULL)
+    {
+      g_clear_pointer (&p->path, g_free);
+      g_clear_pointer (&p->uri, g_free);
+      p->queried = FALSE;
+      p->status  = -1;
+      p->width   = 0;
+      p->height  = 0;
+      p->format  = NULL;
+      p->n_frames         = 0;
+      p->default_is_frame = FALSE;
+      p->shrink           = 0;
+      g_clear_pointer (&p->animation, animation_free);
+    }
+}
+
+static Priv *
+priv_get (GeglProperties *o)
+{
+  if (g_once_init_enter (&o->user_data))
+    {
+      Priv *p = g_new0 (Priv, 1);
+
+      g_mutex_init (&p->mutex);
+      g_once_init_leave (&o->user_data, p);
+    }
+
+  return (Priv*) o->user_data;
+}
+
+static Priv *
+query_cached (GeglOperation *operation)
+{
+  GeglProperties *o = GEGL_PROPERTIES (operation);
+  Priv         *p = priv_get (o);
+  GError       *err = NULL;
+  PngReader     reader;
+  PngLimits     limits;
+  guint64       mtime, size;
+  gboolean      same_file;
+
+  g_mutex_lock (&p->mutex);
+
+  limits_init (&limits, o->max_pixels, o->max_memory, o->max_chunk_size);
+  same_file = p->queried &&
+              ! g_strcmp0 (p->path, o->path) &&
+              ! g_strcmp0 (p->uri, o->uri);
+  if (same_file && ! p->restamp)
+    {
+      mtime = p->mtime;
+      size  = p->size;
+    }
+  else
+    {
+      file_stamp (o, &mtime, &size);
+    }
+  p->restamp = FALSE;
+
+  if (same_file &&
+      p->mtime == mtime && p->size == size &&
+      ! memcmp (&p->limits, &limits, sizeof (PngLimits)) &&
+      p->requested == o->format &&
+      p->trusted == o->trusted)
+    {
+      g_mutex_unlock (&p->mutex);
+      return p;
+    }
+
+  cleanup (operation);
+  p->path    = g_strdup (o->path);
+  p->uri     = g_strdup (o->uri);
+  p->mtime   = mtime;
+  p->size    = size;
+  p->limits  = limits;
+  p->requested = o->format;
+  p->trusted = o->trusted;
+  p->queried = TRUE;
+
+  if (!reader_open (&reader, o->uri, o->path, o->trusted, o->cancellable,
+                   &err))
+    {
+      WARN_IF_ERROR(err);
+      g_clear_error (&err);
+      g_mutex_unlock (&p->mutex);
+      return p;
+    }
+
+  reader.limits = &p->limits;
+
+  arena_acquire ();
+  p->status = query_png(&reader, &p->width, &p->height, &p->format,
+                        &p->n_frames, &p->default_is_frame, &p->shrink,
+                        o->format, o->trusted, &err);
+  arena_release ();
+  WARN_IF_ERROR(err);
+  g_clear_error (&err);
+  reader_close (&reader);
+
+  if (p->status)
+    {
+      p->width  = 0;
+      p->height = 0;
+      p->format = NULL;
+      p->shrink = 0;
+    }
+
+  g_mutex_unlock (&p->mutex);
+
+  return p;
+}
+
+/* checks whether the file was rewritten once per evaluation */
+static void
+prepare (GeglOperation *operation)
+{
+  Priv *p = priv_get (GEGL_PROPERTIES (operation));
+
+  g_mutex_lock (&p->mutex);
+  p->restamp = TRUE;
+  g_mutex_unlock (&p->mutex);
+}
+
+/* whether the frame property asks for more than the default image */
+static gboolean
+loads_frame (GeglProperties *o,
+             Priv           *p)
+{
+  return o->frame > 0 || (p->n_frames > 0 && ! p->default_is_frame);
 }
 
 static GeglRectangle
 get_bounding_box (GeglOperation *operation)
 {
-  GeglProperties   *o = GEGL_PROPERTIES (operation);
+  GeglProperties *o = GEGL_PROPERTIES (operation);
   GeglRectangle result = {0,0,0,0};
-  gint          width, height;
-  gint          status;
-  const Babl *  format;
-  GError *err = NULL;
-  GFile *infile = NULL;
+  Priv         *p = query_cached (operation);
+  const Babl   *format = NULL;
+  gint          shrink;
+
+  g_mutex_lock (&p->mutex);
+  if (p->format)
+    format = output_format (p->format, o->format, loads_frame (o, p));
+  result.width  = p->width;
+  result.height  = p->height;
+  shrink = loads_frame (o, p) ? 0 : p->shrink;
+  g_mutex_unlock (&p->mutex);
+
+  if (format)
+    gegl_operation_set_format (operation, "output", format);
+
+  /* images over the memory budget come in at a reduced size */
+  if (shrink)
+    {
+      result.width  = ((result.width - 1) >> shrink) + 1;
+      result.height = ((result.height - 1) >> shrink) + 1;
+    }
 
-  GInputStream *stream = gegl_gio_open_input_stream(o->uri, o->path, &infile, &err);
-  WARN_IF_ERROR(err);
-  if (!stream) return result;
-  status = query_png(stream, &width, &height, &format, &err);
-  WARN_IF_ERROR(err);
-  g_input_stream_close(stream, NULL, NULL);
+  return result;
+}
+
+/* the canvas of an animation is only touched under the lock of the op */
+static gint
+process_frame (GeglOperation       *operation,
+               GeglBuffer          *output,
+               const GeglRectangle *result,
+               gint                 level,
+               GError             **err)
+{
+  GeglProperties *o = GEGL_PROPERTIES (operation);
+  Priv           *p = query_cached (operation);
+  PngReader       reader;
+  gint            problem = -1;
+
+  g_mutex_lock (&p->mutex);
 
-  if (status)
+  if (! p->status && ! p->animation &&
+      reader_open (&reader, o->uri, o->path, o->trusted, o->cancellable,
+                   err))
     {
-      width = 0;
-      height = 0;
+      GBytes *contents = reader_contents (&reader, err);
+
+      if (contents)
+        {
+          p->animation = animation_new (contents, p->format, &p->limits,
+                                        err);
+          g_bytes_unref (contents);
+        }
+      reader_close (&reader);
     }
 
-  gegl_operation_set_format (operation, "output", format);
-  result.width  = width;
-  result.height  = height;
+  if (p->animation)
+    {
+      PngAnimation  *anim = p->animation;
+      GeglRectangle  canvas = { 0, 0, anim->width, anim->height };
+      GeglRectangle  rect = { result->x << level, result->y << level,
+                              result->width << level,
+                              result->height << level };
+
+      arena_acquire ();
+      if (animation_seek (anim, o->frame, o->trusted, o->cancellable, err))
+        {
+          /* at full resolution, the buffer scales it down */
+          if (gegl_rectangle_intersect (&rect, &rect, &canvas))
+            gegl_buffer_set (output, &rect, 0, anim->format,
+                             anim->canvas +
+                             ((gsize) rect.y * anim->width + rect.x) * 4,
+                             anim->width * 4 * sizeof (gfloat));
+          problem = 0;
+        }
+      arena_release ();
+    }
 
-  g_clear_object(&infile);
-  g_object_unref(stream);
-  return result;
+  g_mutex_unlock (&p->mutex);
+
+  return problem;
 }
 
 static gboolean
@@ -516,26 +3226,56 @@ process (GeglOperation       *operation,
   GeglProperties *o = GEGL_PROPERTIES (operation);
   gint        problem;
   gint        width, height;
-  Babl        *format = NULL;
+  Priv       *p = query_cached (operation);
+  const Babl *format;
+  PngLimits   limits;
+  gint        shrink, status;
+  gboolean    frame;
   GError *err = NULL;
-  GFile *infile = NULL;
-  GInputStream *stream = gegl_gio_open_input_stream(o->uri, o->path, &infile, &err);
-  WARN_IF_ERROR(err);
-  problem = gegl_buffer_import_png (output, stream, 0, 0,
-                                    &width, &height, format, &err);
+  PngReader reader;
+
+  /* decode with a copy, the header can be refilled by another thread */
+  g_mutex_lock (&p->mutex);
+  format = p->format;
+  limits = p->limits;
+  shrink = p->shrink;
+  status = p->status;
+  frame  = loads_frame (o, p);
+  g_mutex_unlock (&p->mutex);
+
+  problem = -1;
+  if (frame)
+    problem = process_frame (operation, output, result, level, &err);
+  else if (! status &&
+           reader_open (&reader, o->uri, o->path, o->trusted,
+                        o->cancellable, &err))
+    {
+      reader.limits = &limits;
+
+      arena_acquire ();
+      /* reduced resolutions are not worth displaying progressively */
+      if (reader.stream && level + shrink == 0)
+        problem = gegl_buffer_import_png_progressive (operation, output,
+                                                      &reader, format,
+                                                      result, o->trusted,
+                                                      &err);
+      else
+        problem = gegl_buffer_import_png (output, &reader, 0, 0,
+                                          &width, &height, format, result,
+                                          level, shrink, o->trusted,
+                                          &err);
+      arena_release ();
+      reader_close (&reader);
+    }
   WARN_IF_ERROR(err);
-  g_input_stream_close(stream, NULL, NULL);
+  g_clear_error (&err);
 
   if (problem)
     {
-      g_object_unref(infile);
-      g_object_unref(stream);
       g_warning ("%s failed to open file %s for reading.",
                  G_OBJECT_TYPE_NAME (operation), o->path);
       return FALSE;
     }
-  g_clear_object(&infile);
-  g_object_unref(stream);
   return TRUE;
 }
 
@@ -543,20 +3283,380 @@ static GeglRectangle
 get_cached_region (GeglOperation       *operation,
                    const GeglRectangle *roi)
 {
-  return get_bounding_box (operation);
+  GeglRectangle bbox = get_bounding_box (operation);
+
+  /* the rows above the roi are decoded anyway, keep them */
+  bbox.height = CLAMP (roi->y + roi->height - bbox.y, 0, bbox.height);
+
+  return bbox;
+}
+
+#else
+
+/* Batch of files, every one opened, queried and decoded once, in
+ * parallel with the others.
+ */
+typedef struct
+{
+  gchar      **files;
+  gint         n_files;
+  const Babl  *format;
+  gboolean     trusted;
+  PngLimits    limits;
+  GCancellable *cancellable;
+  GeglBuffer **buffers;
+  GError     **errors;
+  gint         next;     /* the first file not claimed yet */
+} PngBatch;
+
+/* decodes the image of @file, as gegl:png-load would with its frame
+ * left at 0
+ */
+static GeglBuffer *
+batch_load (const PngBatch *batch,
+            const gchar    *file,
+            GError        **err)
+{
+  const gchar  *uri  = strstr (file, "://") ? file : NULL;
+  const gchar  *path = uri ? NULL : file;
+  PngReader     reader;
+  GeglRectangle extent = {0, 0, 0, 0};
+  const Babl   *file_format;
+  guint         n_frames;
+  gboolean      default_is_frame;
+  gboolean      frame;
+  GeglBuffer   *buffer = NULL;
+  gint          shrink;
+  gint          problem;
+
+  if (! reader_open (&reader, uri, path, batch->trusted,
+                     batch->cancellable, err))
+    return NULL;
+  reader.limits = &batch->limits;
+
+  arena_acquire ();
+  problem = query_png (&reader, &extent.width, &extent.height, &file_format,
+                       &n_frames, &default_is_frame, &shrink,
+                       batch->format, batch->trusted, err);
+  if (problem)
+    goto out;
+
+  /* back to the start, mappings for free, streams from scratch */
+  if (reader.mapped)
+    {
+      reader.offset = 0;
+    }
+  else
+    {
+      reader_close (&reader);
+      problem = -1;
+      if (! reader_open (&reader, uri, path, batch->trusted,
+                         batch->cancellable, err))
+        goto out;
+      reader.limits = &batch->limits;
+    }
+
+  frame = n_frames > 0 && ! default_is_frame;
+
+  /* images over the memory budget come in at a reduced size */
+  if (frame)
+    shrink = 0;
+  if (shrink)
+    {
+      extent.width  = ((extent.width - 1) >> shrink) + 1;
+      extent.height = ((extent.height - 1) >> shrink) + 1;
+    }
+
+  buffer = gegl_buffer_new (&extent,
+                            output_format (file_format, batch->format, frame));
+
+  if (frame)
+    {
+      GBytes       *contents = reader_contents (&reader, err);
+      PngAnimation *anim     = NULL;
+
+      problem = -1;
+      if (contents)
+        {
+          anim = animation_new (contents, file_format, &batch->limits,
+                                err);
+          g_bytes_unref (contents);
+        }
+      /* at full resolution, the buffer scales it down */
+      if (anim && animation_seek (anim, 0, batch->trusted,
+                                  batch->cancellable, err))
+        {
+          gegl_buffer_set (buffer, &extent, 0, anim->format, anim->canvas,
+                           anim->width * 4 * sizeof (gfloat));
+          problem = 0;
+        }
+      g_clear_pointer (&anim, animation_free);
+    }
+  else
+    {
+      problem = gegl_buffer_import_png (buffer, &reader, 0, 0, NULL, NULL,
+                                        file_format, NULL, 0, shrink,
+                                        batch->trusted, err);
+    }
+
+out:
+  arena_release ();
+  reader_close (&reader);
+
+  if (problem)
+    {
+      /* the failures that did not say why */
+      if (err && ! *err)
+        g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "failed to load %s", file);
+      g_clear_object (&buffer);
+    }
+  return buffer;
+}
+
+static void
+batch_worker (gint     i,
+              gint     n,
+              gpointer data)
+{
+  PngBatch *batch = data;
+  gint      file;
+
+  while ((file = g_atomic_int_add (&batch->next, 1)) < batch->n_files)
+    batch->buffers[file] = batch_load (batch, batch->files[file],
+                                       &batch->errors[file]);
+}
+
+/* The batch the properties reference, loaded once under the lock of the
+ * op and kept until a property changes.
+ */
+typedef struct
+{
+  GMutex       mutex;
+  gchar       *paths;
+  PngLimits    limits;
+  const Babl  *requested;
+  gboolean     trusted;
+  gboolean     loaded;
+  PngBatch     batch;
+  gpointer     handed;   /* the buffers property last filled */
+} Priv;
+
+static void
+cleanup (GeglOperation *operation)
+{
+  GeglProperties *o = GEGL_PROPERTIES (operation);
+  Priv *p = (Priv*) o->user_data;
+  gint  i;
+
+  if (p != NULL)
+    {
+      for (i = 0; i < p->batch.n_files; i++)
+        {
+          g_clear_object (&p->batch.buffers[i]);
+          g_clear_error (&p->batch.errors[i]);
+        }
+      g_clear_pointer (&p->batch.files, g_strfreev);
+      g_clear_pointer (&p->batch.buffers, g_free);
+      g_clear_pointer (&p->batch.errors, g_free);
+      g_clear_pointer (&p->paths, g_free);
+      p->batch.n_files = 0;
+      p->loaded = FALSE;
+      p->handed = NULL;
+    }
+}
+
+static Priv *
+priv_get (GeglProperties *o)
+{
+  if (g_once_init_enter (&o->user_data))
+    {
+      Priv *p = g_new0 (Priv, 1);
+
+      g_mutex_init (&p->mutex);
+      g_once_init_leave (&o->user_data, p);
+    }
+
+  return (Priv*) o->user_data;
+}
+
+/* loads the batch if a property changed, and fills the buffers and
+ * errors properties once for every array they point at
+ */
+static Priv *
+batch_cached (GeglOperation *operation)
+{
+  GeglProperties *o = GEGL_PROPERTIES (operation);
+  Priv      *p = priv_get (o);
+  PngLimits  limits;
+  gint       i;
+
+  g_mutex_lock (&p->mutex);
+
+  limits_init (&limits, o->max_pixels, o->max_memory, o->max_chunk_size);
+  if (! p->loaded ||
+      g_strcmp0 (p->paths, o->paths) ||
+      memcmp (&p->limits, &limits, sizeof (PngLimits)) ||
+      p->requested != o->format ||
+      p->trusted != o->trusted)
+    {
+      gchar **lines;
+
+      cleanup (operation);
+      p->paths     = g_strdup (o->paths);
+      p->limits    = limits;
+      p->requested = o->format;
+      p->trusted   = o->trusted;
+      p->loaded    = TRUE;
+
+      /* one file per line, blank lines skipped */
+      lines = g_strsplit (o->paths ? o->paths : "", "\n", -1);
+      p->batch.files = g_new0 (gchar *, g_strv_length (lines) + 1);
+      for (i = 0; lines[i]; i++)
+        if (g_strstrip (lines[i])[0])
+          p->batch.files[p->batch.n_files++] = g_strdup (lines[i]);
+      g_strfreev (lines);
+
+      p->batch.format      = o->format;
+      p->batch.trusted     = o->trusted;
+      p->batch.limits      = limits;
+      p->batch.cancellable = o->cancellable;
+      p->batch.buffers     = g_new0 (GeglBuffer *, p->batch.n_files);
+      p->batch.errors      = g_new0 (GError *, p->batch.n_files);
+      p->batch.next        = 0;
+
+      if (p->batch.n_files > 0)
+        gegl_parallel_distribute (p->batch.n_files, batch_worker, &p->batch);
+      p->batch.cancellable = NULL;
+
+      for (i = 0; i < p->batch.n_files; i++)
+        if (p->batch.errors[i])
+          g_warning ("%s: %s", p->batch.files[i],
+                     p->batch.errors[i]->message);
+    }
+
+  if (o->buffers && o->buffers != p->handed)
+    {
+      GeglBuffer **buffers = o->buffers;
+      GError     **errors  = o->errors;
+
+      for (i = 0; i < p->batch.n_files; i++)
+        {
+          buffers[i] = p->batch.buffers[i] ?
+                       g_object_ref (p->batch.buffers[i]) : NULL;
+          if (errors)
+            errors[i] = p->batch.errors[i] ?
+                        g_error_copy (p->batch.errors[i]) : NULL;
+        }
+      p->handed = o->buffers;
+    }
+
+  g_mutex_unlock (&p->mutex);
+
+  return p;
+}
+
+/* the buffer of the index property, NULL if it did not load */
+static GeglBuffer *
+batch_buffer (GeglProperties *o,
+              Priv           *p)
+{
+  if (o->index >= p->batch.n_files)
+    return NULL;
+
+  return p->batch.buffers[o->index];
+}
+
+static void
+prepare (GeglOperation *operation)
+{
+  GeglProperties *o = GEGL_PROPERTIES (operation);
+  Priv       *p = batch_cached (operation);
+  GeglBuffer *buffer = batch_buffer (o, p);
+
+  if (buffer)
+    gegl_operation_set_format (operation, "output",
+                               gegl_buffer_get_format (buffer));
+  else
+    gegl_operation_set_format (operation, "output",
+                               o->format ? o->format :
+                                           babl_format ("R'G'B'A float"));
+}
+
+static GeglRectangle
+get_bounding_box (GeglOperation *operation)
+{
+  GeglProperties *o = GEGL_PROPERTIES (operation);
+  GeglBuffer     *buffer = batch_buffer (o, batch_cached (operation));
+  GeglRectangle   result = {0, 0, 0, 0};
+
+  if (buffer)
+    result = *gegl_buffer_get_extent (buffer);
+
+  return result;
+}
+
+/* hands out the decoded buffer, as gegl:buffer-source does */
+static gboolean
+process (GeglOperation        *operation,
+         GeglOperationContext *context,
+         const gchar          *output_pad,
+         const GeglRectangle  *result,
+         gint                  level)
+{
+  GeglProperties *o = GEGL_PROPERTIES (operation);
+  GeglBuffer     *buffer = batch_buffer (o, batch_cached (operation));
+
+  if (! buffer)
+    return FALSE;
+
+  gegl_operation_context_take_object (context, "output",
+                                      G_OBJECT (g_object_ref (buffer)));
+  return TRUE;
+}
+
+#endif
+
+static void
+finalize (GObject *object)
+{
+  GeglProperties *o = GEGL_PROPERTIES (object);
+
+  if (o->user_data)
+    {
+      cleanup (GEGL_OPERATION (object));
+      g_mutex_clear (&((Priv*) o->user_data)->mutex);
+      g_clear_pointer (&o->user_data, g_free);
+    }
+
+  G_OBJECT_CLASS (gegl_op_parent_class)->finalize (object);
 }
 
 static void
 gegl_op_class_init (GeglOpClass *klass)
 {
+  GObjectClass             *object_class;
   GeglOperationClass       *operation_class;
-  GeglOperationSourceClass *source_class;
 
+  object_class    = G_OBJECT_CLASS (klass);
   operation_class = GEGL_OPERATION_CLASS (klass);
-  source_class    = GEGL_OPERATION_SOURCE_CLASS (klass);
 
-  source_class->process = process;
+  object_class->finalize = finalize;
+  operation_class->prepare = prepare;
   operation_class->get_bounding_box = get_bounding_box;
+
+#ifdef PNG_LOAD_BATCH
+  operation_class->process = process;
+
+  gegl_operation_class_set_keys (operation_class,
+    "name",         "gegl:png-load-batch",
+    "title",        _("PNG File Batch Loader"),
+    "categories",   "hidden",
+    "description",  _("Loads a list of PNG images in parallel, outputs "
+                      "one of them and hands all of them out."),
+    NULL);
+#else
+  GEGL_OPERATION_SOURCE_CLASS (klass)->process = process;
   operation_class->get_cached_region = get_cached_region;
 
   gegl_operation_class_set_keys (operation_class,
@@ -574,6 +3674,7 @@ gegl_op_class_init (GeglOpClass *klass)
   gegl_operation_handlers_register_loader (
     ".png", "gegl:png-load");
 /*  done = TRUE; */
+#endif
 }
 
 #endif
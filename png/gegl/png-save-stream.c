@@ -0,0 +1,73 @@
+/* This file is an image processing operation for GEGL
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef GEGL_PROPERTIES
+
+enum_start (gegl_png_save_stream_filter)
+  enum_value (GEGL_PNG_SAVE_FILTER_ADAPTIVE, "adaptive", N_("Adaptive"))
+  enum_value (GEGL_PNG_SAVE_FILTER_NONE,     "none",     N_("None"))
+  enum_value (GEGL_PNG_SAVE_FILTER_SUB,      "sub",      N_("Sub"))
+  enum_value (GEGL_PNG_SAVE_FILTER_UP,       "up",       N_("Up"))
+  enum_value (GEGL_PNG_SAVE_FILTER_AVG,      "avg",      N_("Average"))
+  enum_value (GEGL_PNG_SAVE_FILTER_PAETH,    "paeth",    N_("Paeth"))
+enum_end (GeglPngSaveStreamFilter)
+
+enum_start (gegl_png_save_stream_strategy)
+  enum_value (GEGL_PNG_SAVE_STRATEGY_AUTO,     "auto",     N_("Auto"))
+  enum_value (GEGL_PNG_SAVE_STRATEGY_DEFAULT,  "default",  N_("Default"))
+  enum_value (GEGL_PNG_SAVE_STRATEGY_FILTERED, "filtered", N_("Filtered"))
+  enum_value (GEGL_PNG_SAVE_STRATEGY_RLE,      "rle",      N_("RLE"))
+  enum_value (GEGL_PNG_SAVE_STRATEGY_HUFFMAN,  "huffman",  N_("Huffman only"))
+enum_end (GeglPngSaveStreamStrategy)
+
+property_file_path (path, _("File"), "")
+  description (_("Target path and filename, use '-' for stdout."))
+property_int (compression, _("Compression"), 3)
+  description (_("PNG compression level from 1 to 9"))
+  value_range (1, 9)
+property_int (bitdepth, _("Bitdepth"), 16)
+  description (_("8 and 16 are the currently accepted values."))
+  value_range (8, 16)
+property_enum (filter, _("Filter"),
+               GeglPngSaveStreamFilter, gegl_png_save_stream_filter,
+               GEGL_PNG_SAVE_FILTER_ADAPTIVE)
+  description (_("Row filter, adaptive picks the best of all filters per row, "
+                 "none is fastest"))
+property_enum (strategy, _("Strategy"),
+               GeglPngSaveStreamStrategy, gegl_png_save_stream_strategy,
+               GEGL_PNG_SAVE_STRATEGY_AUTO)
+  description (_("Deflate strategy, auto picks the one libpng would"))
+property_int (buffer_size, _("Buffer size"), 256)
+  description (_("Size of each of the two write buffers in kilobytes"))
+  value_range (4, 65536)
+property_boolean (durable, _("Durable"), FALSE)
+  description (_("Sync the file to storage before the save completes"))
+property_boolean (preallocate, _("Preallocate"), FALSE)
+  description (_("Reserve the size of the uncompressed image for local "
+                 "files up front"))
+property_object (cancellable, _("Cancellable"), G_TYPE_CANCELLABLE)
+  description (_("Cancelling it makes the save fail."))
+
+#else
+
+#define GEGL_OP_SINK
+#define GEGL_OP_NAME png_save_stream
+#define GEGL_OP_C_SOURCE png-save-stream.c
+#define PNG_SAVE_STREAM
+
+#include "png-save.c"
+
+#endif
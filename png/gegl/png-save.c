@@ -17,227 +17,1897 @@
  *           2006 Dominik Ernst <dernst@gmx.de>
  */
 
+/* for fallocate () and FALLOC_FL_KEEP_SIZE in <fcntl.h>, and
+ * adler32_combine64 () with a 64 bit length in <zlib.h>
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "config.h"
 #include <glib/gi18n-lib.h>
 
 
-#ifdef GEGL_PROPERTIES
+#ifdef GEGL_PROPERTIES
+
+enum_start (gegl_png_save_filter)
+  enum_value (GEGL_PNG_SAVE_FILTER_ADAPTIVE, "adaptive", N_("Adaptive"))
+  enum_value (GEGL_PNG_SAVE_FILTER_NONE,     "none",     N_("None"))
+  enum_value (GEGL_PNG_SAVE_FILTER_SUB,      "sub",      N_("Sub"))
+  enum_value (GEGL_PNG_SAVE_FILTER_UP,       "up",       N_("Up"))
+  enum_value (GEGL_PNG_SAVE_FILTER_AVG,      "avg",      N_("Average"))
+  enum_value (GEGL_PNG_SAVE_FILTER_PAETH,    "paeth",    N_("Paeth"))
+enum_end (GeglPngSaveFilter)
+
+enum_start (gegl_png_save_strategy)
+  enum_value (GEGL_PNG_SAVE_STRATEGY_AUTO,     "auto",     N_("Auto"))
+  enum_value (GEGL_PNG_SAVE_STRATEGY_DEFAULT,  "default",  N_("Default"))
+  enum_value (GEGL_PNG_SAVE_STRATEGY_FILTERED, "filtered", N_("Filtered"))
+  enum_value (GEGL_PNG_SAVE_STRATEGY_RLE,      "rle",      N_("RLE"))
+  enum_value (GEGL_PNG_SAVE_STRATEGY_HUFFMAN,  "huffman",  N_("Huffman only"))
+enum_end (GeglPngSaveStrategy)
+
+property_file_path (path, _("File"), "")
+  description (_("Target path and filename, use '-' for stdout."))
+property_int (compression, _("Compression"), 3)
+  description (_("PNG compression level from 1 to 9"))
+  value_range (1, 9)
+property_int (bitdepth, _("Bitdepth"), 16)
+  description (_("8 and 16 are the currently accepted values."))
+  value_range (8, 16)
+property_int (threads, _("Threads"), 1)
+  description (_("Number of threads compressing bands of rows, no more "
+                 "than GEGL's own thread count"))
+  value_range (1, 64)
+property_enum (filter, _("Filter"),
+               GeglPngSaveFilter, gegl_png_save_filter,
+               GEGL_PNG_SAVE_FILTER_ADAPTIVE)
+  description (_("Row filter, adaptive picks the best of all filters per row, "
+                 "none is fastest"))
+property_enum (strategy, _("Strategy"),
+               GeglPngSaveStrategy, gegl_png_save_strategy,
+               GEGL_PNG_SAVE_STRATEGY_AUTO)
+  description (_("Deflate strategy, auto picks the one libpng would"))
+property_int (buffer_size, _("Buffer size"), 256)
+  description (_("Size of each of the two write buffers in kilobytes"))
+  value_range (4, 65536)
+property_boolean (durable, _("Durable"), FALSE)
+  description (_("Sync the file to storage before the save completes"))
+property_boolean (preallocate, _("Preallocate"), FALSE)
+  description (_("Reserve the size of the uncompressed image for local "
+                 "files up front"))
+property_object (cancellable, _("Cancellable"), G_TYPE_CANCELLABLE)
+  description (_("Cancelling it makes the save fail."))
+property_int (frames, _("Frames"), 0)
+  description (_("Number of frames of an animated png, each processing "
+                 "appends one.  0 saves a still image"))
+  value_range (0, G_MAXINT)
+property_int (delay, _("Delay"), 100)
+  description (_("Time every frame is shown, in milliseconds"))
+  value_range (0, 65535)
+property_int (loops, _("Loops"), 0)
+  description (_("Number of times an animation plays, 0 for ever"))
+  value_range (0, G_MAXINT)
+
+#else
+
+/* png-save-stream.c builds gegl:png-save-stream from this file */
+#ifndef PNG_SAVE_STREAM
+#define GEGL_OP_SINK
+#define GEGL_OP_NAME png_save
+#define GEGL_OP_C_SOURCE png-save.c
+#endif
+
+#include <gegl-op.h>
+#include <gegl-gio-private.h>
+#include <png.h>
+#include <zlib.h>
+#include "png-common.h"
+#ifdef G_OS_UNIX
+#include <gio/gfiledescriptorbased.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Output of a save.  libpng's writes are gathered in one buffer while the
+ * other is written out asynchronously.  Only durable saves flush and sync.
+ */
+typedef struct
+{
+  GOutputStream *stream;
+  GCancellable  *cancellable;
+  GMainContext  *context;
+  gsize          size;       /* of either buffer */
+  guchar        *buffer;     /* being filled */
+  gsize          length;
+  guchar        *writing;    /* being written out */
+  gboolean       pending;
+  GError        *error;      /* of the last write */
+  goffset        written;    /* in total */
+  gboolean       durable;
+  gboolean       preallocated;
+  gint           fd;         /* of a local file, or -1 */
+} PngWriter;
+
+static PngWriter *
+writer_new (GOutputStream *stream,
+            GCancellable  *cancellable,
+            gsize          size,
+            gboolean       durable)
+{
+  PngWriter *writer = g_new0 (PngWriter, 1);
+
+  writer->stream      = stream;
+  writer->cancellable = cancellable;
+  writer->context     = g_main_context_new ();
+  writer->size        = size;
+  writer->buffer      = g_malloc (size);
+  writer->writing     = g_malloc (size);
+  writer->durable     = durable;
+  writer->fd          = -1;
+
+#ifdef G_OS_UNIX
+  if (G_IS_FILE_DESCRIPTOR_BASED (stream))
+    writer->fd = g_file_descriptor_based_get_fd (
+                   G_FILE_DESCRIPTOR_BASED (stream));
+#endif
+
+  return writer;
+}
+
+/* reserves @size bytes of disk for a regular file written from its start,
+ * without changing its size
+ */
+static void
+writer_preallocate (PngWriter *writer,
+                    goffset    size)
+{
+#if defined (G_OS_UNIX) && defined (FALLOC_FL_KEEP_SIZE)
+  struct stat st;
+
+  if (writer->fd >= 0 &&
+      fstat (writer->fd, &st) == 0 && S_ISREG (st.st_mode) &&
+      lseek (writer->fd, 0, SEEK_CUR) == 0 &&
+      fallocate (writer->fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0)
+    writer->preallocated = TRUE;
+#endif
+}
+
+static void
+writer_ready (GObject      *stream,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+  PngWriter *writer = user_data;
+
+  g_output_stream_write_all_finish (G_OUTPUT_STREAM (stream), result, NULL,
+                                    writer->error ? NULL : &writer->error);
+  writer->pending = FALSE;
+}
+
+/* waits for the write in flight, returns FALSE if any write failed */
+static gboolean
+writer_wait (PngWriter  *writer,
+             GError    **error)
+{
+  while (writer->pending)
+    g_main_context_iteration (writer->context, TRUE);
+
+  if (writer->error)
+    {
+      g_propagate_error (error, writer->error);
+      writer->error = NULL;
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* starts writing out the buffered data */
+static gboolean
+writer_submit (PngWriter  *writer,
+               GError    **error)
+{
+  guchar *swap;
+
+  if (! writer_wait (writer, error))
+    return FALSE;
+  if (! writer->length)
+    return TRUE;
+
+  swap            = writer->writing;
+  writer->writing = writer->buffer;
+  writer->buffer  = swap;
+  writer->pending = TRUE;
+  writer->written += writer->length;
+
+  g_main_context_push_thread_default (writer->context);
+  g_output_stream_write_all_async (writer->stream, writer->writing,
+                                   writer->length, G_PRIORITY_DEFAULT,
+                                   writer->cancellable, writer_ready, writer);
+  g_main_context_pop_thread_default (writer->context);
+  writer->length = 0;
+
+  return TRUE;
+}
+
+static gboolean
+writer_write (PngWriter     *writer,
+              const guchar  *data,
+              gsize          length,
+              GError       **error)
+{
+  if (g_cancellable_set_error_if_cancelled (writer->cancellable, error))
+    return FALSE;
+
+  while (length)
+    {
+      gsize n = MIN (length, writer->size - writer->length);
+
+      memcpy (writer->buffer + writer->length, data, n);
+      writer->length += n;
+      data           += n;
+      length         -= n;
+
+      if (writer->length == writer->size &&
+          ! writer_submit (writer, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/* writes out everything, and for durable writers has it flushed and
+ * synced as well; returns FALSE if any of it failed
+ */
+static gboolean
+writer_flush (PngWriter  *writer,
+              GError    **error)
+{
+  if (! writer_submit (writer, error) || ! writer_wait (writer, error))
+    return FALSE;
+
+  if (! writer->durable)
+    return TRUE;
+
+  if (! g_output_stream_flush (writer->stream, writer->cancellable, error))
+    return FALSE;
+
+#ifdef G_OS_UNIX
+  /* pipes and the like can not be synced, and need not be */
+  if (writer->fd >= 0 && fsync (writer->fd) && errno != EINVAL)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "%s", g_strerror (errno));
+      return FALSE;
+    }
+#endif
+
+  return TRUE;
+}
+
+/* completes the output, returns FALSE if any of it failed */
+static gboolean
+writer_finish (PngWriter  *writer,
+               GError    **error)
+{
+  if (! writer_flush (writer, error))
+    return FALSE;
+
+#ifdef G_OS_UNIX
+  /* truncating to the size the file already has frees the blocks
+   * reserved past it; the file is complete either way
+   */
+  if (writer->preallocated && ftruncate (writer->fd, writer->written))
+    g_warning ("could not release the space reserved for PNG file: %s",
+               g_strerror (errno));
+#endif
+
+  return TRUE;
+}
+
+/* drops what was not written yet, the stream is left to the caller */
+static void
+writer_free (PngWriter *writer)
+{
+  writer_wait (writer, NULL);
+  g_main_context_unref (writer->context);
+  g_free (writer->buffer);
+  g_free (writer->writing);
+  g_free (writer);
+}
+
+static void
+write_fn(png_structp png_ptr, png_bytep buffer, png_size_t length)
+{
+  GError *err = NULL;
+  PngWriter *writer = png_get_io_ptr(png_ptr);
+  g_assert(writer);
+
+  PNG_TRACE (PNG_STATS (png_ptr), PNG_PHASE_IO, length,
+             writer_write (writer, buffer, length, &err));
+  if (err) {
+    gchar message[256];
+
+    /* a file missing some of its data is no success */
+    g_strlcpy (message, err->message, sizeof (message));
+    g_error_free (err);
+    png_error (png_ptr, message);
+  }
+}
+
+static void
+flush_fn(png_structp png_ptr)
+{
+  GError *err = NULL;
+  PngWriter *writer = png_get_io_ptr(png_ptr);
+  g_assert(writer);
+
+  /* advisory, the file is complete once the stream is closed */
+  if (! writer->durable)
+    return;
+
+  writer_flush (writer, &err);
+  if (err) {
+    gchar message[256];
+
+    /* the failed write is gone from the writer now, and with it the
+     * only record that the file is incomplete
+     */
+    g_strlcpy (message, err->message, sizeof (message));
+    g_error_free (err);
+    png_error (png_ptr, message);
+  }
+}
+
+/* State of a single save.  libpng errors are recorded in it and unwind to
+ * the setjmp of the function writing.
+ */
+typedef struct
+{
+#ifdef GEGL_PNG_TRACE
+  PngStats     stats;       /* first, for PNG_STATS () */
+#endif
+  png_structp  png;
+  png_infop    info;
+  gchar       *message;
+  GPtrArray   *owned;
+} PngContext;
+
+static void
+error_fn (png_structp     png_ptr,
+          png_const_charp msg)
+{
+  PngContext *ctx = png_get_error_ptr (png_ptr);
+
+  /* the first error is the interesting one */
+  if (! ctx->message)
+    ctx->message = g_strdup (msg);
+
+  png_longjmp (png_ptr, 1);
+}
+
+static PngContext *
+context_new (void)
+{
+  PngContext *ctx = g_new0 (PngContext, 1);
+
+#ifdef GEGL_PNG_TRACE
+  ctx->stats.name  = "png-save";
+  ctx->stats.start = g_get_monotonic_time ();
+#endif
+
+  ctx->png = png_create_write_struct (PNG_LIBPNG_VER_STRING, ctx,
+                                      error_fn, NULL);
+  if (ctx->png)
+    ctx->info = png_create_info_struct (ctx->png);
+
+  if (! ctx->info)
+    {
+      png_destroy_write_struct (&ctx->png, NULL);
+      g_free (ctx);
+      return NULL;
+    }
+
+  ctx->owned = g_ptr_array_new_with_free_func (g_free);
+
+  return ctx;
+}
+
+/* hands @ptr over to the context, it is freed along with the context
+ * unless it is passed to context_free () before
+ */
+static gpointer
+context_take (PngContext *ctx,
+              gpointer    ptr)
+{
+  g_ptr_array_add (ctx->owned, ptr);
+
+  return ptr;
+}
+
+static void
+context_free (PngContext *ctx,
+              gpointer    ptr)
+{
+  if (! g_ptr_array_remove_fast (ctx->owned, ptr))
+    g_free (ptr);
+}
+
+static void
+context_destroy (PngContext *ctx)
+{
+  png_destroy_write_struct (&ctx->png, &ctx->info);
+#ifdef GEGL_PNG_TRACE
+  png_stats_emit (&ctx->stats, "GEGL_PNG_SAVE_TRACE");
+#endif
+  g_ptr_array_unref (ctx->owned);
+  g_free (ctx->message);
+  g_free (ctx);
+}
+
+#ifndef PNG_SAVE_STREAM
+/* Band-parallel encoding.  The image is split into bands of rows that are
+ * filtered and deflated independently, every band but the last ending on a
+ * full flush and every band but the first starting with a None or Sub
+ * filtered row, which together make up an ordinary zlib stream.  A gePB
+ * chunk records the rows per band and the offset of every band.
+ */
+#define PNG_MAX_IDAT_SIZE  (1 << 30)
+#define PNG_BANDS_MIN_ROWS 64
+
+typedef struct
+{
+  guchar  *data;         /* deflate data, plus zlib header and trailer */
+  gsize    length;
+  gsize    deflate_length;
+  guint32  adler;
+} PngBand;
+
+typedef struct
+{
+  GeglBuffer   *input;
+  const guchar *plane;        /* rows to take instead of fetching input */
+  gsize         plane_stride;
+  const Babl   *format;
+  gint          src_x;
+  gint          src_y;
+  png_uint_32   width;
+  png_uint_32   height;
+  gsize         rowbytes;
+  gint          bpp;
+  gint          bit_depth;
+  gint          compression;
+  gint          strategy;
+  guint         filters;
+  guint32       band_rows;
+  guint32       n_bands;
+  PngBand      *bands;
+  gint          threads;
+  gint          next_band;
+  gint          failed;
+} PngBandsJob;
+
+static inline guint
+png_paeth (gint a,
+           gint b,
+           gint c)
+{
+  gint p  = a + b - c;
+  gint pa = ABS (p - a);
+  gint pb = ABS (p - b);
+  gint pc = ABS (p - c);
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  else if (pb <= pc)
+    return b;
+  return c;
+}
+
+/* filters @row into @out, or, with @out NULL, only returns the sum of the
+ * absolute values of the filtered bytes taken as signed, libpng's measure
+ * for picking a filter.
+ */
+static gsize
+png_filter_row (guchar       *out,
+                const guchar *row,
+                const guchar *prev, // NULL for an all zero row
+                gsize         rowbytes,
+                gint          bpp,
+                guint         filter)
+{
+  gsize sum = 0;
+  gsize i;
+
+  for (i = 0; i < rowbytes; i++)
+    {
+      guint  a = i >= bpp ? row[i - bpp] : 0;
+      guint  b = prev ? prev[i] : 0;
+      guint  c = prev && i >= bpp ? prev[i - bpp] : 0;
+      guchar v = row[i];
+
+      switch (filter)
+        {
+          case PNG_FILTER_VALUE_SUB:   v -= a;                     break;
+          case PNG_FILTER_VALUE_UP:    v -= b;                     break;
+          case PNG_FILTER_VALUE_AVG:   v -= (a + b) >> 1;          break;
+          case PNG_FILTER_VALUE_PAETH: v -= png_paeth (a, b, c);   break;
+          default:                                                 break;
+        }
+
+      if (out)
+        out[i] = v;
+      else
+        sum += ABS ((gint8) v);
+    }
+
+  return sum;
+}
+
+/* filters @row with the best of the filters in @filters, a mask of
+ * PNG_FILTER_NONE to PNG_FILTER_PAETH as passed to png_set_filter ().
+ */
+static void
+png_filter_row_select (guchar       *out,
+                       const guchar *row,
+                       const guchar *prev,
+                       gsize         rowbytes,
+                       gint          bpp,
+                       guint         filters)
+{
+  guint best     = PNG_FILTER_VALUE_NONE;
+  gsize best_sum = G_MAXSIZE;
+  guint filter;
+
+  for (filter = PNG_FILTER_VALUE_NONE; filter < PNG_FILTER_VALUE_LAST; filter++)
+    {
+      gsize sum;
+
+      if (! (filters & (PNG_FILTER_NONE << filter)))
+        continue;
+
+      /* a single candidate needs no measuring */
+      if (filters == (PNG_FILTER_NONE << filter))
+        {
+          best = filter;
+          break;
+        }
+
+      sum = png_filter_row (NULL, row, prev, rowbytes, bpp, filter);
+
+      if (sum < best_sum)
+        {
+          best     = filter;
+          best_sum = sum;
+        }
+    }
+
+  out[0] = best;
+  png_filter_row (out + 1, row, prev, rowbytes, bpp, best);
+}
+
+/* zlib counts in uInt, longer data is handed to it in parts */
+static guint32
+adler32_long (guint32       adler,
+              const guchar *data,
+              gsize         length)
+{
+  while (length)
+    {
+      uInt n = MIN (length, G_MAXUINT);
+
+      adler   = adler32 (adler, data, n);
+      data   += n;
+      length -= n;
+    }
+
+  return adler;
+}
+
+static gboolean
+band_deflate (PngBand      *band,
+              const guchar *data,
+              gsize         length,
+              gint          compression,
+              gint          strategy,
+              gsize         header,
+              gsize         trailer,
+              gboolean      last)
+{
+  z_stream zs;
+  gsize    capacity;
+  gsize    out = 0;
+  gint     ret;
+
+  memset (&zs, 0, sizeof (zs));
+  if (deflateInit2 (&zs, compression, Z_DEFLATED, -15, 8,
+                    strategy) != Z_OK)
+    return FALSE;
+
+  capacity   = header + deflateBound (&zs, length) + 16 + trailer;
+  band->data = g_malloc (capacity);
+  zs.next_in = (Bytef *) data;
+
+  while (TRUE)
+    {
+      gsize space = capacity - header - trailer - out;
+      uInt  avail;
+
+      /* zlib counts in uInt */
+      if (! zs.avail_in && length)
+        {
+          zs.avail_in  = MIN (length, G_MAXUINT);
+          length      -= zs.avail_in;
+        }
+      if (! space)
+        {
+          capacity   *= 2;
+          band->data  = g_realloc (band->data, capacity);
+          space       = capacity - header - trailer - out;
+        }
+      zs.next_out  = band->data + header + out;
+      zs.avail_out = avail = MIN (space, G_MAXUINT);
+
+      ret = deflate (&zs, length ? Z_NO_FLUSH :
+                          last   ? Z_FINISH   : Z_FULL_FLUSH);
+      out += avail - zs.avail_out;
+
+      if (ret == Z_STREAM_ERROR)
+        break;
+      if (length)
+        continue;
+      if (last ? ret == Z_STREAM_END : zs.avail_in == 0 && zs.avail_out > 0)
+        break;
+    }
+
+  band->deflate_length = out;
+  band->length         = header + out;
+  deflateEnd (&zs);
+
+  return ret != Z_STREAM_ERROR;
+}
+
+/* one of at most @job->threads workers, taking bands until none are left */
+static void
+bands_encode_worker (gint     i,
+                     gint     n,
+                     gpointer user_data)
+{
+  PngBandsJob *job      = user_data;
+  gsize        stride   = job->rowbytes + 1;
+  guchar      *pixels   = g_malloc (job->rowbytes * job->band_rows);
+  guchar      *filtered = g_malloc (stride * job->band_rows);
+  gint         b;
+
+  while ((b = g_atomic_int_add (&job->next_band, 1)) < (gint) job->n_bands &&
+         ! g_atomic_int_get (&job->failed))
+    {
+      png_uint_32   y0 = b * job->band_rows;
+      png_uint_32   n  = MIN (job->band_rows, job->height - y0);
+      GeglRectangle rect;
+      png_uint_32   r;
+
+      if (job->plane)
+        {
+          for (r = 0; r < n; r++)
+            memcpy (pixels + r * job->rowbytes,
+                    job->plane + (gsize) (y0 + r) * job->plane_stride,
+                    job->rowbytes);
+        }
+      else
+        {
+          gegl_rectangle_set (&rect, job->src_x, job->src_y + y0,
+                              job->width, n);
+          gegl_buffer_get (job->input, &rect, 1.0, job->format, pixels,
+                           GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+          if (job->bit_depth == 16)
+            swap_bytes_16 (pixels, job->rowbytes * n);
+#endif
+        }
+
+      for (r = 0; r < n; r++)
+        {
+          const guchar *row     = pixels + r * job->rowbytes;
+          const guchar *prev    = r ? row - job->rowbytes : NULL;
+          guint         filters = job->filters;
+
+          /* the first row of a band may not look at the band above it */
+          if (r == 0 && b)
+            {
+              filters &= PNG_FILTER_NONE | PNG_FILTER_SUB;
+              if (! filters)
+                filters = PNG_FILTER_SUB;
+            }
+
+          png_filter_row_select (filtered + r * stride, row, prev,
+                                 job->rowbytes, job->bpp, filters);
+        }
+
+      job->bands[b].adler = adler32_long (adler32 (0, NULL, 0), filtered,
+                                          stride * n);
+
+      if (! band_deflate (&job->bands[b], filtered, stride * n,
+                          job->compression, job->strategy,
+                          b == 0 ? 2 : 0,
+                          b == job->n_bands - 1 ? 4 : 0,
+                          b == job->n_bands - 1))
+        g_atomic_int_set (&job->failed, TRUE);
+    }
+
+  g_free (filtered);
+  g_free (pixels);
+}
+
+static void
+write_idat (png_structp   png,
+            const guchar *data,
+            gsize         length)
+{
+  while (length)
+    {
+      gsize n = MIN (length, PNG_MAX_IDAT_SIZE);
+
+      png_write_chunk (png, (png_const_bytep) "IDAT", data, n);
+      data   += n;
+      length -= n;
+    }
+}
+
+static void
+bands_setup (PngBandsJob         *job,
+             GeglBuffer          *input,
+             const GeglRectangle *result,
+             const Babl          *format,
+             gint                 bit_depth,
+             gint                 compression,
+             guint                filters,
+             gint                 strategy,
+             gint                 threads)
+{
+  memset (job, 0, sizeof (PngBandsJob));
+  job->input       = input;
+  job->format      = format;
+  job->src_x       = result->x;
+  job->src_y       = result->y;
+  job->width       = result->width;
+  job->height      = result->height;
+  job->bpp         = babl_format_get_bytes_per_pixel (format);
+  job->rowbytes    = (gsize) job->width * job->bpp;
+  job->bit_depth   = bit_depth;
+  job->compression = compression;
+  job->filters     = filters;
+  job->threads     = threads;
+
+  /* libpng's choice when no strategy was set */
+  if (strategy < 0)
+    strategy = filters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+  job->strategy    = strategy;
+
+  /* a couple of bands per thread for balance, in whole tile rows */
+  job->band_rows = (job->height + threads * 2 - 1) / (threads * 2);
+  job->band_rows = MAX (job->band_rows, PNG_BANDS_MIN_ROWS);
+  job->band_rows = (job->band_rows + PNG_BANDS_MIN_ROWS - 1) /
+                   PNG_BANDS_MIN_ROWS * PNG_BANDS_MIN_ROWS;
+  job->n_bands   = (job->height + job->band_rows - 1) / job->band_rows;
+}
+
+/* filters and deflates the bands of @job, which together make up one zlib
+ * stream.  Returns the payload of the gePB chunk, or NULL if the stream is
+ * too long for its offsets; both are owned by @ctx.
+ */
+static guchar *
+bands_compress (PngContext  *ctx,
+                PngBandsJob *job)
+{
+  guchar  *chunk;
+  guint64  offset;
+  guint32  adler;
+  guint32  b;
+  gint     flevel;
+  gint     compression = job->compression;
+
+  job->bands = context_take (ctx, g_new0 (PngBand, job->n_bands));
+
+  gegl_parallel_distribute (MIN (job->threads, (gint) job->n_bands),
+                            bands_encode_worker, job);
+
+  for (b = 0; b < job->n_bands; b++)
+    context_take (ctx, job->bands[b].data);
+
+  if (job->failed)
+    png_error (ctx->png, "failed to compress image data");
+
+  /* zlib header, 32k window, with the level hint libpng would use */
+  flevel = compression < 2 ? 0 : compression < 6 ? 1 : compression == 6 ? 2 : 3;
+  job->bands[0].data[0] = 0x78;
+  job->bands[0].data[1] = flevel << 6;
+  job->bands[0].data[1] += 31 - (0x7800 + job->bands[0].data[1]) % 31;
+
+  chunk  = context_take (ctx, g_malloc (4 + 4 * job->n_bands));
+  offset = 2;
+  adler  = job->bands[0].adler;
+  png_put_u32 (chunk, job->band_rows);
+
+  for (b = 0; b < job->n_bands; b++)
+    {
+      png_uint_32 n = MIN (job->band_rows, job->height - b * job->band_rows);
+
+      if (b)
+        adler = adler32_combine64 (adler, job->bands[b].adler,
+                                   (z_off64_t) (job->rowbytes + 1) * n);
+      png_put_u32 (chunk + 4 + 4 * b, offset);
+      offset += job->bands[b].deflate_length;
+    }
+
+  png_put_u32 (job->bands[job->n_bands - 1].data +
+               job->bands[job->n_bands - 1].length, adler);
+  job->bands[job->n_bands - 1].length += 4;
+
+  /* the offsets are 32 bit, larger streams are written without them */
+  if (offset > G_MAXUINT32 - 4)
+    {
+      context_free (ctx, chunk);
+      return NULL;
+    }
+
+  return chunk;
+}
+
+static void
+bands_free (PngContext  *ctx,
+            PngBandsJob *job)
+{
+  guint32 b;
+
+  for (b = 0; b < job->n_bands; b++)
+    context_free (ctx, job->bands[b].data);
+  context_free (ctx, job->bands);
+}
+
+/* encodes and writes the image data and the trailing IEND chunk, returns
+ * FALSE if the image is too small to be worth splitting and nothing was
+ * written.
+ */
+static gboolean
+export_bands (PngContext          *ctx,
+              GeglBuffer          *input,
+              const GeglRectangle *result,
+              const Babl          *format,
+              gint                 bit_depth,
+              gint                 compression,
+              guint                filters,
+              gint                 strategy,
+              gint                 threads)
+{
+  png_structp png = ctx->png;
+  PngBandsJob job;
+  guchar     *chunk;
+  guint32     b;
+
+  bands_setup (&job, input, result, format, bit_depth, compression,
+               filters, strategy, threads);
+  if (job.n_bands < 2)
+    return FALSE;
+
+  chunk = bands_compress (ctx, &job);
+  if (chunk)
+    png_write_chunk (png, (png_const_bytep) PNG_BANDS_CHUNK,
+                     chunk, 4 + 4 * job.n_bands);
+  context_free (ctx, chunk);
+
+  for (b = 0; b < job.n_bands; b++)
+    write_idat (png, job.bands[b].data, job.bands[b].length);
+  bands_free (ctx, &job);
+
+  /* libpng did not see the image data, so png_write_end () would refuse */
+  png_write_chunk (png, (png_const_bytep) "IEND", NULL, 0);
+
+  return TRUE;
+}
+#endif
+
+/* size of the rows setup_header () writes, a bound on most files */
+static goffset
+raw_size (const Babl *babl,
+          gint        bit_depth,
+          gint        width,
+          gint        height)
+{
+  gint n_components = babl_format_get_n_components (babl);
+  gint channels;
+
+  if (babl_format_has_alpha (babl))
+    channels = n_components != 2 ? 4 : 2;
+  else
+    channels = n_components != 1 ? 3 : 1;
+
+  return (goffset) height *
+         (1 + (goffset) width * channels * (bit_depth == 16 ? 2 : 1));
+}
+
+/* sets up the header chunks of an image of @width x @height, rendered in
+ * @babl, and returns the format its rows are written in
+ */
+static const Babl *
+setup_header (PngContext  *ctx,
+              const Babl  *babl,
+              gint         bit_depth,
+              png_uint_32  width,
+              png_uint_32  height)
+{
+  png_structp    png  = ctx->png;
+  png_infop      info = ctx->info;
+  png_color_16   white;
+  int            png_color_type;
+  gchar          format_string[16];
+  const Babl    *space = babl_format_get_space (babl);
+
+  {
+
+    if (bit_depth != 16)
+      bit_depth = 8;
+
+    if (babl_format_has_alpha (babl))
+      if (babl_format_get_n_components (babl) != 2)
+        {
+          png_color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+          strcpy (format_string, "R'G'B'A ");
+        }
+      else
+        {
+          png_color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+          strcpy (format_string, "Y'A ");
+        }
+    else
+      if (babl_format_get_n_components (babl) != 1)
+        {
+          png_color_type = PNG_COLOR_TYPE_RGB;
+          strcpy (format_string, "R'G'B' ");
+        }
+      else
+        {
+          png_color_type = PNG_COLOR_TYPE_GRAY;
+          strcpy (format_string, "Y' ");
+        }
+  }
+
+  if (bit_depth == 16)
+    strcat (format_string, "u16");
+  else
+    strcat (format_string, "u8");
+
+  png_set_IHDR (png, info,
+     width, height, bit_depth, png_color_type,
+     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_DEFAULT);
+
+  if (
+      (png_color_type == PNG_COLOR_TYPE_RGB || png_color_type == PNG_COLOR_TYPE_RGB_ALPHA))
+    {
+      if (space == NULL || space == babl_space ("sRGB"))
+      {
+        white.red = 0xff;
+        white.blue = 0xff;
+        white.green = 0xff;
+        png_set_sRGB_gAMA_and_cHRM (png, info, PNG_sRGB_INTENT_RELATIVE);
+      }
+      else
+      {
+
+        double wp[2];
+        double red[2];
+        double green[2];
+        double blue[2];
+        const Babl *trc[3];
+        int is_cmyk = babl_space_is_cmyk (space);
+
+        babl_space_get (space, &wp[0], &wp[1],
+                        &red[0], &red[1],
+                        &green[0], &green[1],
+                        &blue[0], &blue[1],
+                        &trc[0], &trc[1], &trc[2]);
+        png_set_cHRM (png, info, wp[0], wp[1], red[0], red[1], green[0], green[1], blue[0], blue[1]);
+      /* XXX: should also set gamma based on trc! */
+        if (trc[0] == babl_trc("sRGB") ||
+            trc[0] == babl_trc("2.2") || is_cmyk)
+        {
+          png_set_gAMA (png, info, 2.2);
+        }
+        else if (trc[0] == babl_trc("linear"))
+        {
+          png_set_gAMA (png, info, 1.0);
+        }
+        else
+        {
+          png_set_gAMA (png, info, 2.2);
+        }
+
+        if (!is_cmyk) {
+          int icc_len;
+          const char *name = babl_get_name (space);
+          const char *icc_profile;
+          if (strlen (name) > 10) name = "GEGL";
+          icc_profile = babl_space_get_icc (space, &icc_len);
+          if (icc_profile)
+          {
+             png_set_iCCP (png, info,
+                           name, 0, (void*)icc_profile, icc_len);
+          }
+        }
+      }
+    }
+  else
+    {
+      white.gray = 0xff;
+    }
+  png_set_bKGD (png, info, &white);
+
+  return babl_format_with_space (format_string, space);
+}
+
+/* sets up the compression and writes the header of an image of @babl,
+ * returning the format of its rows
+ */
+static const Babl *
+export_header (PngContext  *ctx,
+               const Babl  *babl,
+               gint         compression,
+               gint         bit_depth,
+               guint        filters,
+               gint         strategy,
+               png_uint_32  width,
+               png_uint_32  height)
+{
+  png_structp  png = ctx->png;
+  const Babl  *format;
+
+  png_set_compression_level (png, compression);
+  png_set_filter (png, PNG_FILTER_TYPE_BASE, filters);
+  if (strategy >= 0)
+    png_set_compression_strategy (png, strategy);
+
+  format = setup_header (ctx, babl, bit_depth, width, height);
+
+  PNG_TRACE (PNG_STATS (png), PNG_PHASE_LIBPNG, 0,
+             png_write_info (png, ctx->info));
+
+  return format;
+}
+
+/* writes the rows of @rect of @input through libpng */
+static void
+export_rows (PngContext          *ctx,
+             GeglBuffer          *input,
+             const GeglRectangle *rect,
+             const Babl          *format,
+             gint                 bit_depth)
+{
+  png_structp    png = ctx->png;
+  guchar        *pixels;
+  png_bytep     *rows;
+  gsize          rowstride;
+  gint           band_height;
+  gint           n_rows;
+  gint           i;
+
+  /* fetch a band of rows matching the tile height at a time */
+  g_object_get (input, "tile-height", &band_height, NULL);
+  band_height = CLAMP (band_height, 1, MAX (rect->height, 1));
+
+  rowstride = (gsize) rect->width * babl_format_get_bytes_per_pixel (format);
+  pixels    = context_take (ctx, g_malloc0 (rowstride * band_height));
+  rows      = context_take (ctx, g_new (png_bytep, band_height));
+  for (i = 0; i < band_height; i++)
+    rows[i] = pixels + i * rowstride;
+
+  for (i = 0; i < rect->height; i += n_rows)
+    {
+      GeglRectangle band;
+
+      n_rows = MIN (band_height, rect->height - i);
+      gegl_rectangle_set (&band, rect->x, rect->y + i, rect->width, n_rows);
+
+      PNG_TRACE (PNG_STATS (png), PNG_PHASE_BUFFER, 0,
+                 gegl_buffer_get (input, &band, 1.0, format, pixels,
+                                  rowstride, GEGL_ABYSS_NONE));
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+      if (bit_depth == 16)
+        swap_bytes_16 (pixels, rowstride * n_rows);
+#endif
+
+      PNG_TRACE (PNG_STATS (png), PNG_PHASE_LIBPNG, 0,
+                 png_write_rows (png, rows, n_rows));
+    }
+
+  context_free (ctx, rows);
+  context_free (ctx, pixels);
+}
+
+#ifndef PNG_SAVE_STREAM
+static gint
+export_png (PngContext          *ctx,
+            GeglBuffer          *input,
+            const GeglRectangle *result,
+            gint                 compression,
+            gint                 bit_depth,
+            guint                filters,
+            gint                 strategy,
+            gint                 threads)
+{
+  png_structp    png  = ctx->png;
+  const Babl    *format;
+
+  if (setjmp (png_jmpbuf (png)))
+    return -1;
+
+  format = export_header (ctx, gegl_buffer_get_format (input), compression,
+                          bit_depth, filters, strategy,
+                          result->width, result->height);
+
+  if (threads > 1)
+    {
+      gboolean done;
+
+      PNG_TRACE (PNG_STATS (png), PNG_PHASE_BANDS, 0,
+                 done = export_bands (ctx, input, result, format, bit_depth,
+                                      compression, filters, strategy,
+                                      threads));
+      if (done)
+        return 0;
+    }
+
+  export_rows (ctx, input, result, format, bit_depth);
+
+  PNG_TRACE (PNG_STATS (png), PNG_PHASE_LIBPNG, 0,
+             png_write_end (png, ctx->info));
+
+  return 0;
+}
+
+/* Animated pngs.  The op appends its input as the next frame every time
+ * it is processed.  Every frame after the first is cut down to the box
+ * that changed, and fcTL and fdAT are written as raw chunks.  A frame is
+ * held back until the next one arrives, which picks its dispose op: the
+ * one leaving the next frame the smallest box to draw.
+ */
+typedef struct
+{
+  PngContext    *ctx;
+  GOutputStream *stream;
+  PngWriter     *writer;
+  GFile         *file;
+  gchar         *path;
+  gint           n_frames;
+  gint           frame;      /* index of the next frame */
+  gint           written;    /* frames written */
+  guint32        sequence;   /* of the next fcTL or fdAT chunk */
+  const Babl    *format;
+  png_uint_32    width;
+  png_uint_32    height;
+  guchar        *base;       /* the canvas the pending frame is drawn on */
+  guchar        *pending;    /* the frame held back */
+  guchar        *current;    /* the frame being appended */
+  guchar        *plane;      /* pixels blended over, or a disposed canvas */
+  GeglRectangle  box;        /* of the pending frame */
+  guint8         blend_op;
+  gint           delay;
+  PngBandsJob    job;        /* the pending frame, compressed */
+  guchar        *chunk;      /* its gePB payload */
+} PngAnimation;
+
+static PngAnimation *
+animation_new (GeglProperties  *o,
+               GError         **error)
+{
+  PngAnimation *anim = g_new0 (PngAnimation, 1);
+
+  anim->ctx = context_new ();
+  if (anim->ctx == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "failed to initialize PNG writer");
+      g_free (anim);
+      return NULL;
+    }
+
+  anim->stream = gegl_gio_open_output_stream (NULL, o->path, &anim->file,
+                                              error);
+  if (anim->stream == NULL)
+    {
+      context_destroy (anim->ctx);
+      g_clear_object (&anim->file);
+      g_free (anim);
+      return NULL;
+    }
+  anim->writer = writer_new (anim->stream, o->cancellable,
+                             o->buffer_size * 1024, o->durable);
+  png_set_write_fn (anim->ctx->png, anim->writer, write_fn, flush_fn);
+
+  anim->path     = g_strdup (o->path);
+  anim->n_frames = o->frames;
+
+  return anim;
+}
+
+static void
+animation_free (PngAnimation *anim)
+{
+  if (anim->frame < anim->n_frames)
+    g_warning ("%s: animation ended after %d of %d frames",
+               anim->path, anim->frame, anim->n_frames);
+
+  context_destroy (anim->ctx);
+  writer_free (anim->writer);
+  g_clear_object (&anim->stream);
+  g_clear_object (&anim->file);
+  g_free (anim->path);
+  g_free (anim);
+}
+
+static void
+write_fdat (png_structp   png,
+            PngAnimation *anim,
+            const guchar *data,
+            gsize         length)
+{
+  while (length)
+    {
+      gsize  n = MIN (length, PNG_MAX_IDAT_SIZE - 4);
+      guchar sequence[4];
+
+      png_put_u32 (sequence, anim->sequence++);
+      png_write_chunk_start (png, (png_const_bytep) "fdAT", n + 4);
+      png_write_chunk_data (png, sequence, 4);
+      png_write_chunk_data (png, data, n);
+      png_write_chunk_end (png);
+      data   += n;
+      length -= n;
+    }
+}
+
+/* narrows @box to the pixels of @frame that differ from @canvas, FALSE if
+ * none do
+ */
+static gboolean
+frame_box (PngAnimation  *anim,
+           const guchar  *frame,
+           const guchar  *canvas,
+           GeglRectangle *box)
+{
+  gint  bpp      = babl_format_get_bytes_per_pixel (anim->format);
+  gsize rowbytes = (gsize) anim->width * bpp;
+  gint  x0 = anim->width, x1 = -1;
+  gint  y0 = anim->height, y1 = -1;
+  gint  x, y;
+
+  for (y = 0; y < anim->height; y++)
+    {
+      const guchar *cur  = frame + y * rowbytes;
+      const guchar *prev = canvas + y * rowbytes;
+
+      if (! memcmp (cur, prev, rowbytes))
+        continue;
+
+      y0 = MIN (y0, y);
+      y1 = y;
+      for (x = 0; x < x0; x++)
+        if (memcmp (cur + x * bpp, prev + x * bpp, bpp))
+          x0 = x;
+      for (x = anim->width - 1; x > x1; x--)
+        if (memcmp (cur + x * bpp, prev + x * bpp, bpp))
+          x1 = x;
+    }
+
+  if (y1 < 0)
+    return FALSE;
+
+  gegl_rectangle_set (box, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+  return TRUE;
+}
+
+/* the number of pixels drawing @frame on @canvas takes */
+static guint64
+frame_cost (PngAnimation *anim,
+            const guchar *frame,
+            const guchar *canvas)
+{
+  GeglRectangle box;
+
+  if (! frame_box (anim, frame, canvas, &box))
+    return 0;
+
+  return (guint64) box.width * box.height;
+}
+
+/* makes @box of @canvas transparent black, as APNG_DISPOSE_OP_BACKGROUND */
+static void
+canvas_clear (PngAnimation        *anim,
+              guchar              *canvas,
+              const GeglRectangle *box)
+{
+  gint  bpp      = babl_format_get_bytes_per_pixel (anim->format);
+  gsize rowbytes = (gsize) anim->width * bpp;
+  gint  y;
+
+  for (y = box->y; y < box->y + box->height; y++)
+    memset (canvas + y * rowbytes + box->x * bpp, 0,
+            (gsize) box->width * bpp);
+}
+
+/* cuts the pending frame down to the pixels that differ from the base,
+ * and picks the blend op to write them with
+ */
+static void
+frame_delta (PngAnimation *anim)
+{
+  gint          bpp      = babl_format_get_bytes_per_pixel (anim->format);
+  gsize         rowbytes = (gsize) anim->width * bpp;
+  GeglRectangle box;
+  gint          alpha    = 0;
+  gint          x, y;
+
+  anim->blend_op = APNG_BLEND_OP_SOURCE;
+
+  /* a frame can not be empty, repeat a pixel */
+  if (! frame_box (anim, anim->pending, anim->base, &box))
+    {
+      gegl_rectangle_set (&anim->box, 0, 0, 1, 1);
+      return;
+    }
+  anim->box = box;
+
+  if (babl_format_has_alpha (anim->format))
+    alpha = bpp / babl_format_get_n_components (anim->format);
+  if (! alpha)
+    return;
+
+  /* OVER only puts down opaque pixels unchanged */
+  for (y = box.y; y < box.y + box.height; y++)
+    for (x = box.x; x < box.x + box.width; x++)
+      {
+        const guchar *cur  = anim->pending + y * rowbytes + x * bpp;
+        const guchar *prev = anim->base + y * rowbytes + x * bpp;
+
+        if (memcmp (cur, prev, bpp) &&
+            (cur[bpp - 1] != 0xff || cur[bpp - alpha] != 0xff))
+          return;
+      }
+
+  for (y = box.y; y < box.y + box.height; y++)
+    for (x = box.x; x < box.x + box.width; x++)
+      {
+        const guchar *cur   = anim->pending + y * rowbytes + x * bpp;
+        const guchar *prev  = anim->base + y * rowbytes + x * bpp;
+        guchar       *plane = anim->plane + y * rowbytes + x * bpp;
+
+        if (memcmp (cur, prev, bpp))
+          memcpy (plane, cur, bpp);
+        else
+          memset (plane, 0, bpp);
+      }
+
+  anim->blend_op = APNG_BLEND_OP_OVER;
+}
+
+/* the dispose op of the pending frame that leaves the current one the
+ * least to draw: BACKGROUND when it clears pixels the pending frame put
+ * down, PREVIOUS when the pending frame was an overlay it drops
+ */
+static guint8
+frame_dispose (PngAnimation *anim)
+{
+  gsize   rowbytes = (gsize) anim->width *
+                     babl_format_get_bytes_per_pixel (anim->format);
+  guint8  dispose  = APNG_DISPOSE_OP_NONE;
+  guint64 best, cost;
+
+  best = frame_cost (anim, anim->current, anim->pending);
+
+  memcpy (anim->plane, anim->pending, rowbytes * anim->height);
+  canvas_clear (anim, anim->plane, &anim->box);
+  cost = frame_cost (anim, anim->current, anim->plane);
+  if (cost < best)
+    {
+      dispose = APNG_DISPOSE_OP_BACKGROUND;
+      best    = cost;
+    }
+
+  /* decoders take PREVIOUS on the first frame for BACKGROUND */
+  if (anim->written > 0 &&
+      frame_cost (anim, anim->current, anim->base) < best)
+    dispose = APNG_DISPOSE_OP_PREVIOUS;
+
+  return dispose;
+}
+
+/* writes the pending frame and disposes of it on the base */
+static void
+frame_write (PngAnimation *anim,
+             guint8        dispose_op)
+{
+  PngContext *ctx      = anim->ctx;
+  png_structp png      = ctx->png;
+  gsize       rowbytes = (gsize) anim->width *
+                         babl_format_get_bytes_per_pixel (anim->format);
+  guchar      fctl[26];
+  guint32     b;
+
+  png_put_u32 (fctl, anim->sequence++);
+  png_put_u32 (fctl + 4, anim->box.width);
+  png_put_u32 (fctl + 8, anim->box.height);
+  png_put_u32 (fctl + 12, anim->box.x);
+  png_put_u32 (fctl + 16, anim->box.y);
+  png_save_uint_16 (fctl + 20, anim->delay);
+  png_save_uint_16 (fctl + 22, 1000);
+  fctl[24] = dispose_op;
+  fctl[25] = anim->blend_op;
+  png_write_chunk (png, (png_const_bytep) "fcTL", fctl, 26);
+
+  if (anim->written == 0)
+    {
+      if (anim->chunk && anim->job.n_bands > 1)
+        png_write_chunk (png, (png_const_bytep) PNG_BANDS_CHUNK,
+                         anim->chunk, 4 + 4 * anim->job.n_bands);
+      for (b = 0; b < anim->job.n_bands; b++)
+        write_idat (png, anim->job.bands[b].data, anim->job.bands[b].length);
+    }
+  else
+    {
+      for (b = 0; b < anim->job.n_bands; b++)
+        write_fdat (png, anim, anim->job.bands[b].data,
+                    anim->job.bands[b].length);
+    }
+  context_free (ctx, anim->chunk);
+  anim->chunk = NULL;
+  bands_free (ctx, &anim->job);
+  anim->written++;
+
+  /* PREVIOUS leaves the base as it was */
+  if (dispose_op != APNG_DISPOSE_OP_PREVIOUS)
+    memcpy (anim->base, anim->pending, rowbytes * anim->height);
+  if (dispose_op == APNG_DISPOSE_OP_BACKGROUND)
+    canvas_clear (anim, anim->base, &anim->box);
+}
+
+static gint
+export_frame (GeglBuffer          *input,
+              const GeglRectangle *result,
+              PngAnimation        *anim,
+              gint                 compression,
+              gint                 bit_depth,
+              guint                filters,
+              gint                 strategy,
+              gint                 threads,
+              gint                 delay,
+              gint                 loops)
+{
+  PngContext    *ctx = anim->ctx;
+  png_structp    png = ctx->png;
+  const guchar  *plane;
+  guchar        *swap;
+  gsize          rowbytes;
+  gsize          size;
+  gint           bpp;
+
+  if (setjmp (png_jmpbuf (png)))
+    return -1;
+
+  if (bit_depth != 16)
+    bit_depth = 8;
+
+  if (anim->frame == 0)
+    {
+      guchar actl[8];
+
+      anim->width  = result->width;
+      anim->height = result->height;
+      anim->format = setup_header (ctx, gegl_buffer_get_format (input),
+                                   bit_depth, anim->width, anim->height);
+      PNG_TRACE (PNG_STATS (png), PNG_PHASE_LIBPNG, 0,
+                 png_write_info (png, ctx->info));
+
+      png_put_u32 (actl, anim->n_frames);
+      png_put_u32 (actl + 4, loops);
+      png_write_chunk (png, (png_const_bytep) "acTL", actl, 8);
+
+      size = (gsize) anim->width * anim->height *
+             babl_format_get_bytes_per_pixel (anim->format);
+      /* the canvas starts out transparent black */
+      anim->base    = context_take (ctx, g_malloc0 (size));
+      anim->pending = context_take (ctx, g_malloc (size));
+      anim->current = context_take (ctx, g_malloc (size));
+      anim->plane   = context_take (ctx, g_malloc (size));
+    }
+  else if (result->width != anim->width || result->height != anim->height)
+    {
+      png_error (png, "frames of an animation differ in size");
+    }
+
+  bpp      = babl_format_get_bytes_per_pixel (anim->format);
+  rowbytes = (gsize) anim->width * bpp;
+
+  PNG_TRACE (PNG_STATS (png), PNG_PHASE_BUFFER, 0,
+             gegl_buffer_get (input, result, 1.0, anim->format,
+                              anim->current, rowbytes, GEGL_ABYSS_NONE));
 
-property_file_path (path, _("File"), "")
-  description (_("Target path and filename, use '-' for stdout."))
-property_int (compression, _("Compression"), 3)
-  description (_("PNG compression level from 1 to 9"))
-  value_range (1, 9)
-property_int (bitdepth, _("Bitdepth"), 16)
-  description (_("8 and 16 are the currently accepted values."))
-  value_range (8, 16)
+#if BYTE_ORDER == LITTLE_ENDIAN
+  if (bit_depth == 16)
+    swap_bytes_16 (anim->current, rowbytes * anim->height);
+#endif
 
-#else
+  if (anim->frame > 0)
+    frame_write (anim, frame_dispose (anim));
 
-#define GEGL_OP_SINK
-#define GEGL_OP_NAME png_save
-#define GEGL_OP_C_SOURCE png-save.c
+  swap          = anim->pending;
+  anim->pending = anim->current;
+  anim->current = swap;
+  anim->delay   = delay;
 
-#include <gegl-op.h>
-#include <gegl-gio-private.h>
-#include <png.h>
+  /* the first frame is the default image, and covers all of it */
+  if (anim->frame == 0)
+    {
+      gegl_rectangle_set (&anim->box, 0, 0, anim->width, anim->height);
+      anim->blend_op = APNG_BLEND_OP_SOURCE;
+    }
+  else
+    {
+      frame_delta (anim);
+    }
 
-static void
-write_fn(png_structp png_ptr, png_bytep buffer, png_size_t length)
-{
-  GError *err = NULL;
-  GOutputStream *stream = G_OUTPUT_STREAM(png_get_io_ptr(png_ptr));
-  gsize bytes_written = 0;
-  g_assert(stream);
+  plane = anim->blend_op == APNG_BLEND_OP_OVER ? anim->plane : anim->pending;
+  bands_setup (&anim->job, NULL, &anim->box, anim->format, bit_depth,
+               compression, filters, strategy, threads);
+  anim->job.plane        = plane + anim->box.y * rowbytes + anim->box.x * bpp;
+  anim->job.plane_stride = rowbytes;
+  PNG_TRACE (PNG_STATS (png), PNG_PHASE_BANDS, 0,
+             anim->chunk = bands_compress (ctx, &anim->job));
 
-  g_output_stream_write_all(stream, buffer, length, &bytes_written, NULL, &err);
-  if (err) {
-    g_printerr("gegl:save-png %s: %s\n", __PRETTY_FUNCTION__, err->message);
-  }
+  if (++anim->frame == anim->n_frames)
+    {
+      frame_write (anim, APNG_DISPOSE_OP_NONE);
+      png_write_chunk (png, (png_const_bytep) "IEND", NULL, 0);
+    }
+
+  return 0;
 }
+#endif
 
-static void
-flush_fn(png_structp png_ptr)
+typedef struct
 {
-  GError *err = NULL;
-  GOutputStream *stream = G_OUTPUT_STREAM(png_get_io_ptr(png_ptr));
-  g_assert(stream);
+  PngContext    *ctx;
+  GOutputStream *stream;
+  PngWriter     *writer;
+  GFile         *file;
+#ifdef PNG_SAVE_STREAM
+  gchar         *path;
+  GeglRectangle  extent;      /* of the input, empty between saves */
+  guint64        remaining;   /* pixels still to come */
+  guint32       *covered;     /* pixels received of every row */
+  GeglBuffer    *staging;     /* rows received and not written yet */
+  const Babl    *format;      /* of the rows written */
+  gint           written;     /* rows written */
+  gboolean       failed;      /* the chunks still to come are dropped */
+#endif
+} PngSave;
 
-  g_output_stream_flush(stream, NULL, &err);
-  if (err) {
-    g_printerr("gegl:save-png %s: %s\n", __PRETTY_FUNCTION__, err->message);
-  }
+static void
+warn_export (PngContext *ctx)
+{
+  if (ctx->message)
+    g_warning ("could not export PNG file: %s", ctx->message);
+  else
+    g_warning ("could not export PNG file");
 }
 
-static void
-error_fn(png_structp png_ptr, png_const_charp msg)
+static gboolean
+save_open (PngSave             *save,
+           GeglProperties      *o,
+           const Babl          *babl,
+           const GeglRectangle *extent)
 {
-  g_printerr("LIBPNG ERROR: %s", msg);
+  GError *error = NULL;
+
+  save->ctx = context_new ();
+  if (save->ctx == NULL)
+    {
+      g_warning ("failed to initialize PNG writer");
+      return FALSE;
+    }
+
+  save->stream = gegl_gio_open_output_stream (NULL, o->path, &save->file,
+                                              &error);
+  if (save->stream == NULL)
+    {
+      g_warning ("%s", error->message);
+      g_clear_error (&error);
+      return FALSE;
+    }
+
+  save->writer = writer_new (save->stream, o->cancellable,
+                             o->buffer_size * 1024, o->durable);
+  png_set_write_fn (save->ctx->png, save->writer, write_fn, flush_fn);
+
+  /* not for standard output, which is not ours to trim */
+  if (o->preallocate && strcmp (o->path, "-"))
+    writer_preallocate (save->writer,
+                        raw_size (babl, o->bitdepth,
+                                  extent->width, extent->height));
+
+  return TRUE;
 }
 
-static gint
-export_png (GeglOperation       *operation,
-            GeglBuffer          *input,
-            const GeglRectangle *result,
-            png_structp          png,
-            png_infop            info,
-            gint                 compression,
-            gint                 bit_depth)
+/* closes the file, completing it if @complete; FALSE if that failed */
+static gboolean
+save_close (PngSave  *save,
+            gboolean  complete)
 {
-  gint           i, src_x, src_y;
-  png_uint_32    width, height;
-  guchar        *pixels;
-  png_color_16   white;
-  int            png_color_type;
-  gchar          format_string[16];
-  const Babl    *babl = gegl_buffer_get_format (input);
-  const Babl    *space = babl_format_get_space (babl);
-  const Babl    *format;
+  gboolean  status = TRUE;
+  GError   *error  = NULL;
 
-  src_x = result->x;
-  src_y = result->y;
-  width = result->width;
-  height = result->height;
+  if (complete && ! writer_finish (save->writer, &error))
+    {
+      g_warning ("could not export PNG file: %s", error->message);
+      g_clear_error (&error);
+      status = FALSE;
+    }
 
-  {
+  g_clear_pointer (&save->ctx, context_destroy);
+  g_clear_pointer (&save->writer, writer_free);
+  g_clear_object (&save->stream);
+  g_clear_object (&save->file);
 
-    if (bit_depth != 16)
-      bit_depth = 8;
+  return status;
+}
 
-    if (babl_format_has_alpha (babl))
-      if (babl_format_get_n_components (babl) != 2)
-        {
-          png_color_type = PNG_COLOR_TYPE_RGB_ALPHA;
-          strcpy (format_string, "R'G'B'A ");
-        }
-      else
-        {
-          png_color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
-          strcpy (format_string, "Y'A ");
-        }
-    else
-      if (babl_format_get_n_components (babl) != 1)
+#ifndef PNG_SAVE_STREAM
+static gboolean
+append_frame (GeglOperation       *operation,
+              GeglBuffer          *input,
+              const GeglRectangle *result,
+              guint                filters,
+              gint                 strategy)
+{
+  GeglProperties *o = GEGL_PROPERTIES (operation);
+  PngAnimation   *anim = o->user_data;
+  GError         *error = NULL;
+
+  /* another file starts another animation */
+  if (anim && (g_strcmp0 (anim->path, o->path) ||
+               anim->n_frames != o->frames))
+    g_clear_pointer (&o->user_data, animation_free);
+
+  if (o->user_data == NULL)
+    {
+      o->user_data = animation_new (o, &error);
+      if (o->user_data == NULL)
         {
-          png_color_type = PNG_COLOR_TYPE_RGB;
-          strcpy (format_string, "R'G'B' ");
+          g_warning ("%s", error->message);
+          g_clear_error (&error);
+          return FALSE;
         }
-      else
+    }
+  anim = o->user_data;
+
+  if (export_frame (input, result, anim, o->compression, o->bitdepth,
+                    filters, strategy, o->threads, o->delay, o->loops))
+    {
+      warn_export (anim->ctx);
+      g_clear_pointer (&o->user_data, animation_free);
+      return FALSE;
+    }
+
+  if (anim->frame == anim->n_frames)
+    {
+      gboolean done = writer_finish (anim->writer, &error);
+
+      if (! done)
         {
-          png_color_type = PNG_COLOR_TYPE_GRAY;
-          strcpy (format_string, "Y' ");
+          g_warning ("could not export PNG file: %s", error->message);
+          g_clear_error (&error);
         }
-  }
-
-  if (bit_depth == 16)
-    strcat (format_string, "u16");
-  else
-    strcat (format_string, "u8");
+      g_clear_pointer (&o->user_data, animation_free);
+      return done;
+    }
 
-  if (setjmp (png_jmpbuf (png)))
-    return -1;
+  return TRUE;
+}
 
-  png_set_compression_level (png, compression);
+static gboolean
+save_png (GeglProperties      *o,
+          GeglBuffer          *input,
+          const GeglRectangle *result,
+          guint                filters,
+          gint                 strategy)
+{
+  PngSave save = { 0, };
 
-  png_set_IHDR (png, info,
-     width, height, bit_depth, png_color_type,
-     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_DEFAULT);
+  if (! save_open (&save, o, gegl_buffer_get_format (input), result))
+    {
+      save_close (&save, FALSE);
+      return FALSE;
+    }
 
-  if (
-      (png_color_type == PNG_COLOR_TYPE_RGB || png_color_type == PNG_COLOR_TYPE_RGB_ALPHA))
+  if (export_png (save.ctx, input, result, o->compression, o->bitdepth,
+                  filters, strategy, o->threads))
     {
-      if (space == NULL || space == babl_space ("sRGB"))
-      {
-        white.red = 0xff;
-        white.blue = 0xff;
-        white.green = 0xff;
-        png_set_sRGB_gAMA_and_cHRM (png, info, PNG_sRGB_INTENT_RELATIVE);
-      }
-      else
-      {
+      warn_export (save.ctx);
+      save_close (&save, FALSE);
+      return FALSE;
+    }
 
-        double wp[2];
-        double red[2];
-        double green[2];
-        double blue[2];
-        const Babl *trc[3];
-        int is_cmyk = babl_space_is_cmyk (space);
+  return save_close (&save, TRUE);
+}
 
-        babl_space_get (space, &wp[0], &wp[1],
-                        &red[0], &red[1],
-                        &green[0], &green[1],
-                        &blue[0], &blue[1],
-                        &trc[0], &trc[1], &trc[2]);
-        png_set_cHRM (png, info, wp[0], wp[1], red[0], red[1], green[0], green[1], blue[0], blue[1]);
-      /* XXX: should also set gamma based on trc! */
-        if (trc[0] == babl_trc("sRGB") ||
-            trc[0] == babl_trc("2.2") || is_cmyk)
-        {
-          png_set_gAMA (png, info, 2.2);
-        }
-        else if (trc[0] == babl_trc("linear"))
-        {
-          png_set_gAMA (png, info, 1.0);
-        }
-        else
-        {
-          png_set_gAMA (png, info, 2.2);
-        }
+#else
 
-        if (!is_cmyk) {
-          int icc_len;
-          const char *name = babl_get_name (space);
-          const char *icc_profile;
-          if (strlen (name) > 10) name = "GEGL";
-          icc_profile = babl_space_get_icc (space, &icc_len);
-          if (icc_profile)
-          {
-             png_set_iCCP (png, info,
-                           name, 0, (void*)icc_profile, icc_len);
-          }
-        }
-      }
+/* gegl:png-save-stream is not a needs_full sink, GEGL hands process () its
+ * input a chunk at a time, and every row is written as soon as all of its
+ * pixels have arrived.  A chunk overfilling a row belongs to another
+ * rendering, and starts the save over.
+ */
+static void
+save_begin (PngSave             *save,
+            GeglProperties      *o,
+            GeglBuffer          *input,
+            const GeglRectangle *extent)
+{
+  save->path      = g_strdup (o->path);
+  save->extent    = *extent;
+  save->remaining = (guint64) extent->width * extent->height;
+  save->covered   = g_new0 (guint32, extent->height);
+  save->staging   = gegl_buffer_new (extent, gegl_buffer_get_format (input));
+}
+
+/* ends the save, dropping whatever of it was not written */
+static void
+save_reset (PngSave *save)
+{
+  save_close (save, FALSE);
+  g_clear_object (&save->staging);
+  g_clear_pointer (&save->covered, g_free);
+  g_clear_pointer (&save->path, g_free);
+  gegl_rectangle_set (&save->extent, 0, 0, 0, 0);
+  save->remaining = 0;
+  save->format    = NULL;
+  save->written   = 0;
+  save->failed    = FALSE;
+}
+
+/* whether @chunk gives any of its rows more pixels than it has */
+static gboolean
+save_overlaps (PngSave             *save,
+               const GeglRectangle *chunk)
+{
+  gint y;
+
+  for (y = chunk->y - save->extent.y;
+       y < chunk->y - save->extent.y + chunk->height; y++)
+    if (save->covered[y] + chunk->width > (guint32) save->extent.width)
+      return TRUE;
+
+  return FALSE;
+}
+
+/* writes the rows that are complete, opening the file first */
+static gboolean
+save_rows (PngSave        *save,
+           GeglProperties *o,
+           guint           filters,
+           gint            strategy)
+{
+  GeglRectangle rows;
+  gint          end = save->written;
+
+  while (end < save->extent.height &&
+         save->covered[end] == save->extent.width)
+    end++;
+
+  if (! save->ctx &&
+      ! save_open (save, o, gegl_buffer_get_format (save->staging),
+                   &save->extent))
+    return FALSE;
+
+  if (setjmp (png_jmpbuf (save->ctx->png)))
+    {
+      warn_export (save->ctx);
+      return FALSE;
     }
-  else
+
+  if (! save->format)
+    save->format = export_header (save->ctx,
+                                  gegl_buffer_get_format (save->staging),
+                                  o->compression, o->bitdepth, filters,
+                                  strategy, save->extent.width,
+                                  save->extent.height);
+
+  if (end > save->written)
     {
-      white.gray = 0xff;
+      gegl_rectangle_set (&rows, save->extent.x,
+                          save->extent.y + save->written,
+                          save->extent.width, end - save->written);
+      export_rows (save->ctx, save->staging, &rows, save->format,
+                   o->bitdepth);
+
+      /* releases the tiles of the rows */
+      gegl_buffer_clear (save->staging, &rows);
+      save->written = end;
     }
-  png_set_bKGD (png, info, &white);
 
-  format = babl_format_with_space (format_string, space);
+  if (save->written == save->extent.height)
+    PNG_TRACE (PNG_STATS (save->ctx->png), PNG_PHASE_LIBPNG, 0,
+               png_write_end (save->ctx->png, save->ctx->info));
 
+  return TRUE;
+}
 
-  if (space && space != babl_space("sRGB"))
-  {
-  }
+static gboolean
+save_chunk (GeglOperation       *operation,
+            GeglBuffer          *input,
+            const GeglRectangle *result,
+            guint                filters,
+            gint                 strategy)
+{
+  GeglProperties      *o = GEGL_PROPERTIES (operation);
+  PngSave             *save = o->user_data;
+  const GeglRectangle *bounds;
+  GeglRectangle        extent;
+  GeglRectangle        chunk;
+  gboolean             status = TRUE;
+  gint                 y;
 
-  png_write_info (png, info);
+  bounds = gegl_operation_source_get_bounding_box (operation, "input");
+  extent = bounds ? *bounds : *result;
+  if (! gegl_rectangle_intersect (&chunk, result, &extent))
+    return TRUE;
 
-#if BYTE_ORDER == LITTLE_ENDIAN
-  if (bit_depth > 8)
-    png_set_swap (png);
-#endif
-  pixels = g_malloc0 (width * babl_format_get_bytes_per_pixel (format));
+  if (save == NULL)
+    save = o->user_data = g_new0 (PngSave, 1);
 
-  for (i=0; i< height; i++)
+  if (save->covered &&
+      (g_strcmp0 (save->path, o->path) ||
+       ! gegl_rectangle_equal (&save->extent, &extent) ||
+       save_overlaps (save, &chunk)))
     {
-      GeglRectangle rect;
+      g_warning ("%s: input rendered again before all of it was saved, "
+                 "starting over", save->path);
+      save_reset (save);
+    }
 
-      rect.x = src_x;
-      rect.y = src_y+i;
-      rect.width = width;
-      rect.height = 1;
+  if (! save->covered)
+    save_begin (save, o, input, &extent);
 
-      gegl_buffer_get (input, &rect, 1.0, format, pixels, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+  save->remaining -= (guint64) chunk.width * chunk.height;
+  for (y = chunk.y; y < chunk.y + chunk.height; y++)
+    save->covered[y - extent.y] += chunk.width;
+
+  if (! save->failed)
+    {
+      gegl_buffer_copy (input, &chunk, GEGL_ABYSS_NONE,
+                        save->staging, &chunk);
 
-      png_write_rows (png, &pixels, 1);
+      if (! save_rows (save, o, filters, strategy))
+        save->failed = TRUE;
+      else if (save->written == save->extent.height)
+        status = save_close (save, TRUE);
     }
 
-  png_write_end (png, info);
+  /* the rest of the chunks of the rendering are dropped */
+  if (save->failed)
+    {
+      save_close (save, FALSE);
+      g_clear_object (&save->staging);
+      status = FALSE;
+    }
 
-  g_free (pixels);
+  if (save->remaining == 0)
+    save_reset (save);
 
-  return 0;
+  return status;
 }
+#endif
 
 static gboolean
 process (GeglOperation       *operation,
@@ -246,65 +1916,87 @@ process (GeglOperation       *operation,
          gint                 level)
 {
   GeglProperties *o = GEGL_PROPERTIES (operation);
-  png_structp png = NULL;
-  png_infop info = NULL;
-  GOutputStream *stream = NULL;
-  GFile *file = NULL;
-  gboolean status = TRUE;
-  GError *error = NULL;
-
-  png = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, error_fn, NULL);
-  if (png != NULL)
-    info = png_create_info_struct (png);
-  if (png == NULL || info == NULL)
+  static const guint filters[] =
     {
-      status = FALSE;
-      g_warning ("failed to initialize PNG writer");
-      goto cleanup;
-    }
-
-  stream = gegl_gio_open_output_stream (NULL, o->path, &file, &error);
-  if (stream == NULL)
+      [GEGL_PNG_SAVE_FILTER_ADAPTIVE] = PNG_ALL_FILTERS,
+      [GEGL_PNG_SAVE_FILTER_NONE]     = PNG_FILTER_NONE,
+      [GEGL_PNG_SAVE_FILTER_SUB]      = PNG_FILTER_SUB,
+      [GEGL_PNG_SAVE_FILTER_UP]       = PNG_FILTER_UP,
+      [GEGL_PNG_SAVE_FILTER_AVG]      = PNG_FILTER_AVG,
+      [GEGL_PNG_SAVE_FILTER_PAETH]    = PNG_FILTER_PAETH
+    };
+  /* -1 leaves the choice to libpng */
+  static const gint strategies[] =
     {
-      status = FALSE;
-      g_warning ("%s", error->message);
-      goto cleanup;
-    }
+      [GEGL_PNG_SAVE_STRATEGY_AUTO]     = -1,
+      [GEGL_PNG_SAVE_STRATEGY_DEFAULT]  = Z_DEFAULT_STRATEGY,
+      [GEGL_PNG_SAVE_STRATEGY_FILTERED] = Z_FILTERED,
+      [GEGL_PNG_SAVE_STRATEGY_RLE]      = Z_RLE,
+      [GEGL_PNG_SAVE_STRATEGY_HUFFMAN]  = Z_HUFFMAN_ONLY
+    };
 
-  png_set_write_fn (png, stream, write_fn, flush_fn);
+#ifdef PNG_SAVE_STREAM
+  return save_chunk (operation, input, result, filters[o->filter],
+                     strategies[o->strategy]);
+#else
+  if (o->frames > 0)
+    return append_frame (operation, input, result, filters[o->filter],
+                         strategies[o->strategy]);
 
-  if (export_png (operation, input, result, png, info, o->compression, o->bitdepth))
-    {
-      status = FALSE;
-      g_warning("could not export PNG file");
-      goto cleanup;
-    }
+  return save_png (o, input, result, filters[o->filter],
+                   strategies[o->strategy]);
+#endif
+}
 
-cleanup:
-  if (info != NULL)
-    png_destroy_write_struct (&png, &info);
-  else if (png != NULL)
-    png_destroy_write_struct (&png, NULL);
+static void
+finalize (GObject *object)
+{
+  GeglProperties *o = GEGL_PROPERTIES (object);
 
-  if (stream != NULL)
-    g_clear_object(&stream);
+#ifdef PNG_SAVE_STREAM
+  PngSave *save = o->user_data;
 
-  if (file != NULL)
-    g_clear_object(&file);
+  if (save)
+    {
+      if (save->covered && ! save->failed)
+        g_warning ("%s: not saved, the input was only rendered in part",
+                   save->path);
+      save_reset (save);
+      g_clear_pointer (&o->user_data, g_free);
+    }
+#else
+  /* of an animation that did not get all of its frames */
+  g_clear_pointer (&o->user_data, animation_free);
+#endif
 
-  return status;
+  G_OBJECT_CLASS (gegl_op_parent_class)->finalize (object);
 }
 
 static void
 gegl_op_class_init (GeglOpClass *klass)
 {
+  GObjectClass           *object_class;
   GeglOperationClass     *operation_class;
   GeglOperationSinkClass *sink_class;
 
+  object_class    = G_OBJECT_CLASS (klass);
   operation_class = GEGL_OPERATION_CLASS (klass);
   sink_class      = GEGL_OPERATION_SINK_CLASS (klass);
 
+  object_class->finalize = finalize;
   sink_class->process    = process;
+
+#ifdef PNG_SAVE_STREAM
+  sink_class->needs_full = FALSE;
+
+  gegl_operation_class_set_keys (operation_class,
+    "name",          "gegl:png-save-stream",
+    "title",       _("PNG File Stream Saver"),
+    "categories" ,   "output",
+    "description", _("PNG image saver writing every row as soon as it is "
+                     "rendered, using libpng"),
+    NULL);
+#else
   sink_class->needs_full = TRUE;
 
   gegl_operation_class_set_keys (operation_class,
@@ -316,6 +2008,7 @@ gegl_op_class_init (GeglOpClass *klass)
 
   gegl_operation_handlers_register_saver (
     ".png", "gegl:png-save");
+#endif
 }
 
 #endif
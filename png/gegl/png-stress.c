@@ -0,0 +1,1472 @@
+/* This file is part of GEGL
+ *
+ * GEGL is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * GEGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with GEGL; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Stress test of gegl:png-load, gating on regressions.
+ *
+ * Every png given on the command line, or found below a directory given
+ * there, is queried and loaded through a fresh gegl:png-load node, which
+ * is query_png () and gegl_buffer_import_png ().  With -m, each is also
+ * rewritten into that many mutants that keep its structure valid, with
+ * the checksums recomputed, so that they reach past the crc checks:
+ * image data split into tiny IDATs, a chunk repeated many times, a chunk
+ * of a type from the dictionary given with -d inserted with random
+ * content, a chunk dropped, or the image data cut short.  The mutants are
+ * derived from the name of the input, the same ones on every run.
+ *
+ * What an input costs is the time taken and the peak memory above what
+ * was resident before, the least of the repeats, each per byte of the file
+ * or of the pixels it loaded to, whichever is larger; an input that fails
+ * to load, which png-load reports with a warning, only counts its file.
+ * The costs are given relative to the median of the run, which makes
+ * them comparable between machines, and an input whose cost is more than
+ * -x times the median, 8 by default, is flagged as out of proportion to
+ * its size: a decompression bomb, or quadratic behaviour.
+ *
+ * Inputs are named by their path below the directory given for them, or
+ * as given if they were given themselves, and the baseline is keyed on
+ * those names.  Given a baseline with -b, the run fails when an input
+ * costs more than -t times its baseline, 2 by default, or more than -t
+ * times the median if its baseline is below that, so that noise in the
+ * cheapest inputs is not taken for a regression.  An input flagged as
+ * out of proportion and not in the baseline fails the run too.  -w
+ * writes the costs of the run as the baseline instead.  Compare runs over
+ * the same inputs, the costs are relative to their median.
+ *
+ * The results are printed as a JSON array with one object per input, the
+ * failures also on stderr, and the exit status is 1 on a regression.
+ *
+ * With -c the inputs are checked instead, for the pixels every path
+ * through the ops gives, as described above reference_decode (); the
+ * seeds in png/gegl, the gePB bands, apng and adam7 ones among them, are
+ * what it is run over:
+ *
+ *   ./png-stress -c .
+ *
+ *   cc -O2 png-stress.c png-bench-alloc.c -o png-stress \
+ *      $(pkg-config --cflags --libs gegl-0.4 libpng zlib)
+ *
+ * No baseline comes with it, the costs depend on the GEGL and babl the
+ * ops run against.  Write one with -w on the machine and build that
+ * gates, then check later runs against it with -b, over the same inputs
+ * and mutants; from png/gegl:
+ *
+ *   ./png-stress -w png-stress.baseline -m 5 -d ../../dictionaries/png.dict .
+ *   ./png-stress -b png-stress.baseline -m 5 -d ../../dictionaries/png.dict .
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <gegl.h>
+#include <png.h>
+#include <zlib.h>
+
+#include "png-bench.h"
+
+#define STRESS_MIN_WORK     (64 * 1024) /* bytes, below it all costs the same */
+#define STRESS_MIN_TIME     1000        /* microseconds */
+#define STRESS_MIN_MEMORY   64          /* kilobytes, as STRESS_MIN_WORK */
+#define STRESS_MAX_REPEATED (1 << 20)   /* bytes a mutant repeats a chunk for */
+
+typedef struct
+{
+  gchar          type[5];
+  const guchar  *data;
+  guint32        length;
+} StressChunk;
+
+typedef enum
+{
+  MUTATE_SPLIT_IDAT,
+  MUTATE_REPEAT_CHUNK,
+  MUTATE_INSERT_CHUNK,
+  MUTATE_DROP_CHUNK,
+  MUTATE_TRUNCATE_IDAT,
+  MUTATE_N
+} StressMutation;
+
+typedef struct
+{
+  gchar         *name;          /* of the input, keys the baseline */
+  GeglRectangle  extent;
+  gint64         file_bytes;
+  guint64        pixel_bytes;   /* loaded, 0 if the load failed */
+  gint64         time;          /* in microseconds, of the fastest run */
+  guint64        memory;        /* in kilobytes, above the resident set */
+  guint64        allocations;   /* of the first run */
+  gdouble        time_cost;     /* per byte, then relative to the median */
+  gdouble        memory_cost;
+  gboolean       in_baseline;
+  gdouble        baseline_time_cost;
+  gdouble        baseline_memory_cost;
+  gboolean       out_of_proportion;
+  gboolean       regressed;
+} StressResult;
+
+static const guchar png_signature[8] = { 0x89, 'P', 'N', 'G',
+                                         '\r', '\n', 0x1a, '\n' };
+
+static gint n_warnings;
+
+/* counts the warnings, which is how the ops report failing, and logs them */
+static void
+log_handler (const gchar    *domain,
+             GLogLevelFlags  level,
+             const gchar    *message,
+             gpointer        data)
+{
+  if (level & (G_LOG_LEVEL_WARNING | G_LOG_LEVEL_CRITICAL))
+    g_atomic_int_inc (&n_warnings);
+  g_log_default_handler (domain, level, message, data);
+}
+
+static GeglRectangle
+stress_query (const gchar *path)
+{
+  GeglNode      *graph = gegl_node_new ();
+  GeglNode      *load  = gegl_node_new_child (graph,
+                                              "operation", "gegl:png-load",
+                                              "path",      path,
+                                              NULL);
+  GeglRectangle  extent;
+
+  extent = gegl_node_get_bounding_box (load);
+  g_object_unref (graph);
+
+  return extent;
+}
+
+/* the image in @path, NULL if loading it failed */
+static GeglBuffer *
+stress_load (const gchar *path)
+{
+  GeglNode   *graph    = gegl_node_new ();
+  GeglBuffer *buffer   = NULL;
+  gint        warnings = g_atomic_int_get (&n_warnings);
+  GeglNode   *load;
+  GeglNode   *sink;
+
+  load = gegl_node_new_child (graph,
+                              "operation", "gegl:png-load",
+                              "path",      path,
+                              NULL);
+  sink = gegl_node_new_child (graph,
+                              "operation", "gegl:buffer-sink",
+                              "buffer",    &buffer,
+                              NULL);
+  gegl_node_link (load, sink);
+  gegl_node_process (sink);
+  g_object_unref (graph);
+
+  /* the sink is handed a buffer even when the load fails */
+  if (g_atomic_int_get (&n_warnings) != warnings)
+    g_clear_object (&buffer);
+
+  return buffer;
+}
+
+/* queries and loads @path @repeats times into @result, keeping the least
+ * time and memory, which leaves out what the first load of all allocates
+ */
+static void
+stress_measure (const gchar  *path,
+                gint          repeats,
+                StressResult *result)
+{
+  gint i;
+
+  result->file_bytes = file_size (path);
+
+  for (i = 0; i < repeats; i++)
+    {
+      GeglBuffer *buffer;
+      guint64     resident;
+      guint64     before;
+      guint64     peak;
+      gint64      start;
+      gint64      time;
+
+      peak_rss_reset ();
+      resident = rss ();
+      before   = allocations ();
+      start    = g_get_monotonic_time ();
+
+      result->extent = stress_query (path);
+      buffer = stress_load (path);
+
+      time = g_get_monotonic_time () - start;
+      peak = peak_rss ();
+      peak = peak - MIN (resident, peak);
+      if (i == 0 || time < result->time)
+        result->time = time;
+      if (i == 0 || peak < result->memory)
+        result->memory = peak;
+      if (i == 0)
+        result->allocations = allocations () - before;
+
+      result->pixel_bytes = 0;
+      if (buffer)
+        {
+          const GeglRectangle *extent = gegl_buffer_get_extent (buffer);
+
+          result->pixel_bytes = (guint64) extent->width * extent->height *
+                                babl_format_get_bytes_per_pixel (
+                                  gegl_buffer_get_format (buffer));
+          g_object_unref (buffer);
+        }
+    }
+}
+
+/* the chunks of the png in @data, pointing into it, NULL if it is not one */
+static GArray *
+chunks_parse (const guchar *data,
+              gsize         length)
+{
+  GArray *chunks;
+  gsize   offset = sizeof (png_signature);
+
+  if (length < offset || memcmp (data, png_signature, offset))
+    return NULL;
+
+  chunks = g_array_new (FALSE, FALSE, sizeof (StressChunk));
+  while (length - offset >= 12)
+    {
+      StressChunk chunk;
+
+      chunk.length = (guint32) data[offset]     << 24 |
+                     (guint32) data[offset + 1] << 16 |
+                     (guint32) data[offset + 2] << 8  |
+                     (guint32) data[offset + 3];
+      if (chunk.length > length - offset - 12)
+        break;
+      memcpy (chunk.type, data + offset + 4, 4);
+      chunk.type[4] = '\0';
+      chunk.data    = data + offset + 8;
+      g_array_append_val (chunks, chunk);
+
+      offset += 12 + chunk.length;
+    }
+
+  return chunks;
+}
+
+static void
+append_be32 (GByteArray *out,
+             guint32     value)
+{
+  guchar be[4] = { value >> 24, value >> 16, value >> 8, value };
+
+  g_byte_array_append (out, be, 4);
+}
+
+/* appends @length bytes of @data as a chunk of @type, with its crc */
+static void
+chunk_write (GByteArray   *out,
+             const gchar  *type,
+             const guchar *data,
+             guint32       length)
+{
+  uLong crc = crc32 (0L, (const Bytef *) type, 4);
+
+  crc = crc32 (crc, data, length);
+  append_be32 (out, length);
+  g_byte_array_append (out, (const guint8 *) type, 4);
+  g_byte_array_append (out, data, length);
+  append_be32 (out, crc);
+}
+
+static gboolean
+chunk_is (const StressChunk *chunk,
+          const gchar       *type)
+{
+  return ! strcmp (chunk->type, type);
+}
+
+/* a random chunk of @chunks other than IHDR and IEND, -1 if there is none */
+static gint
+chunk_pick (GArray *chunks,
+            GRand  *rand)
+{
+  gint n = 0;
+  gint pick;
+  guint i;
+
+  for (i = 0; i < chunks->len; i++)
+    n += ! chunk_is (&g_array_index (chunks, StressChunk, i), "IHDR") &&
+         ! chunk_is (&g_array_index (chunks, StressChunk, i), "IEND");
+  if (! n)
+    return -1;
+
+  pick = g_rand_int_range (rand, 0, n);
+  for (i = 0; i < chunks->len; i++)
+    if (! chunk_is (&g_array_index (chunks, StressChunk, i), "IHDR") &&
+        ! chunk_is (&g_array_index (chunks, StressChunk, i), "IEND") &&
+        pick-- == 0)
+      return i;
+
+  return -1;
+}
+
+/* writes mutant @index of the png in @data into @out, with @types the chunk
+ * types to insert; FALSE if @data is not a png
+ */
+static gboolean
+mutate (const guchar *data,
+        gsize         length,
+        const gchar  *name,
+        gint          index,
+        GPtrArray    *types,
+        GByteArray   *out)
+{
+  StressMutation  mutation = index % MUTATE_N;
+  GArray         *chunks   = chunks_parse (data, length);
+  GRand          *rand;
+  gboolean        truncated = FALSE;
+  gint            target;
+  guint           i;
+
+  if (! chunks || ! chunks->len)
+    {
+      if (chunks)
+        g_array_free (chunks, TRUE);
+      return FALSE;
+    }
+
+  rand   = g_rand_new_with_seed (g_str_hash (name) + index);
+  target = chunk_pick (chunks, rand);
+
+  g_byte_array_set_size (out, 0);
+  g_byte_array_append (out, png_signature, sizeof (png_signature));
+
+  for (i = 0; i < chunks->len; i++)
+    {
+      const StressChunk *chunk = &g_array_index (chunks, StressChunk, i);
+
+      if (mutation == MUTATE_SPLIT_IDAT && chunk_is (chunk, "IDAT"))
+        {
+          guint32 offset = 0;
+
+          while (offset < chunk->length)
+            {
+              guint32 size = g_rand_int_range (rand, 1, 65);
+
+              size = MIN (size, chunk->length - offset);
+
+              chunk_write (out, "IDAT", chunk->data + offset, size);
+              offset += size;
+            }
+          continue;
+        }
+      else if (mutation == MUTATE_REPEAT_CHUNK && (gint) i == target)
+        {
+          gint repeats = g_rand_int_range (rand, 2, 1025);
+
+          /* many small chunks, not a file grown by the size of a big one */
+          repeats = MIN (repeats, MAX (STRESS_MAX_REPEATED /
+                                       (chunk->length + 12), 2));
+
+          while (--repeats)
+            chunk_write (out, chunk->type, chunk->data, chunk->length);
+        }
+      else if (mutation == MUTATE_INSERT_CHUNK && (gint) i == target)
+        {
+          const gchar *type;
+          guint32      size = g_rand_int_range (rand, 0, 4097);
+          guchar      *content = g_malloc (MAX (size, 1));
+          guint32      j;
+
+          /* before the chunk picked, so after IHDR whatever that is */
+          type = types->len ?
+                 g_ptr_array_index (types,
+                                    g_rand_int_range (rand, 0, types->len)) :
+                 chunk->type;
+          for (j = 0; j < size; j++)
+            content[j] = g_rand_int (rand);
+          chunk_write (out, type, content, size);
+          g_free (content);
+        }
+      else if (mutation == MUTATE_DROP_CHUNK && (gint) i == target)
+        {
+          continue;
+        }
+      else if (mutation == MUTATE_TRUNCATE_IDAT && chunk_is (chunk, "IDAT") &&
+               ! truncated)
+        {
+          /* the first IDAT, cut short */
+          truncated = TRUE;
+          chunk_write (out, "IDAT", chunk->data,
+                       g_rand_int_range (rand, 0, MAX (chunk->length, 1)));
+          continue;
+        }
+
+      chunk_write (out, chunk->type, chunk->data, chunk->length);
+    }
+
+  g_rand_free (rand);
+  g_array_free (chunks, TRUE);
+
+  return TRUE;
+}
+
+/* the chunk types in the AFL dictionary @path, the four letter entries */
+static GPtrArray *
+dictionary_load (const gchar *path)
+{
+  GPtrArray  *types = g_ptr_array_new_with_free_func (g_free);
+  gchar      *contents;
+  gchar     **lines;
+  gint        i;
+
+  if (! path)
+    return types;
+  if (! g_file_get_contents (path, &contents, NULL, NULL))
+    {
+      g_printerr ("png-stress: could not read %s\n", path);
+      exit (2);
+    }
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i]; i++)
+    {
+      const gchar *value = strchr (lines[i], '"');
+      const gchar *end   = strrchr (lines[i], '"');
+
+      if (lines[i][0] == '#' || ! value || end - value != 5)
+        continue;
+      value++;
+      if (g_ascii_isalpha (value[0]) && g_ascii_isalpha (value[1]) &&
+          g_ascii_isalpha (value[2]) && g_ascii_isalpha (value[3]))
+        g_ptr_array_add (types, g_strndup (value, 4));
+    }
+  g_strfreev (lines);
+  g_free (contents);
+
+  return types;
+}
+
+/* the baseline in @path, from names to pairs of time and memory costs.
+ * Every line is the two costs and the name, escaped as g_strescape ()
+ * does, so that it can hold spaces.
+ */
+static GHashTable *
+baseline_load (const gchar *path)
+{
+  GHashTable  *baseline = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+  gchar       *contents;
+  gchar      **lines;
+  gint         i;
+
+  if (! g_file_get_contents (path, &contents, NULL, NULL))
+    {
+      g_printerr ("png-stress: could not read %s\n", path);
+      exit (2);
+    }
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i]; i++)
+    {
+      gchar  **fields;
+      gdouble *costs;
+
+      if (lines[i][0] == '#' || ! lines[i][0])
+        continue;
+      fields = g_strsplit (lines[i], " ", 3);
+      if (g_strv_length (fields) == 3)
+        {
+          costs    = g_new (gdouble, 2);
+          costs[0] = g_ascii_strtod (fields[0], NULL);
+          costs[1] = g_ascii_strtod (fields[1], NULL);
+          g_hash_table_insert (baseline, g_strcompress (fields[2]), costs);
+        }
+      g_strfreev (fields);
+    }
+  g_strfreev (lines);
+  g_free (contents);
+
+  return baseline;
+}
+
+static gboolean
+baseline_write (const gchar  *path,
+                StressResult *results,
+                guint         n_results)
+{
+  GString  *contents = g_string_new (NULL);
+  gboolean  written;
+  guint     i;
+
+  g_string_append (contents,
+                   "# png-stress baseline: time and memory cost "
+                   "relative to the median, input\n");
+  for (i = 0; i < n_results; i++)
+    {
+      gchar  time[G_ASCII_DTOSTR_BUF_SIZE];
+      gchar  memory[G_ASCII_DTOSTR_BUF_SIZE];
+      gchar *name = g_strescape (results[i].name, NULL);
+
+      g_string_append_printf (contents, "%s %s %s\n",
+                              g_ascii_formatd (time, sizeof (time), "%.3f",
+                                               results[i].time_cost),
+                              g_ascii_formatd (memory, sizeof (memory), "%.3f",
+                                               results[i].memory_cost),
+                              name);
+      g_free (name);
+    }
+  written = g_file_set_contents (path, contents->str, contents->len, NULL);
+  g_string_free (contents, TRUE);
+
+  return written;
+}
+
+static gint
+compare_costs (gconstpointer a,
+               gconstpointer b)
+{
+  gdouble x = *(const gdouble *) a;
+  gdouble y = *(const gdouble *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static gdouble
+median (gdouble *values,
+        guint    n)
+{
+  qsort (values, n, sizeof (gdouble), compare_costs);
+
+  return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/* turns the costs per byte of @results into costs relative to the median */
+static void
+results_normalize (StressResult *results,
+                   guint         n_results)
+{
+  gdouble *times    = g_new (gdouble, n_results);
+  gdouble *memories = g_new (gdouble, n_results);
+  gdouble  time_median;
+  gdouble  memory_median;
+  guint    i;
+
+  for (i = 0; i < n_results; i++)
+    {
+      StressResult *result = &results[i];
+      gdouble       work;
+
+      work = MAX (MAX ((guint64) result->file_bytes, result->pixel_bytes),
+                  STRESS_MIN_WORK);
+      result->time_cost   = MAX (result->time, STRESS_MIN_TIME) / work;
+      result->memory_cost = MAX (result->memory, STRESS_MIN_MEMORY) / work;
+
+      times[i]    = result->time_cost;
+      memories[i] = result->memory_cost;
+    }
+
+  time_median   = median (times, n_results);
+  memory_median = median (memories, n_results);
+  for (i = 0; i < n_results; i++)
+    {
+      results[i].time_cost   /= time_median;
+      results[i].memory_cost /= memory_median;
+    }
+
+  g_free (times);
+  g_free (memories);
+}
+
+/* whether @cost regressed from @baseline by more than @threshold */
+static gboolean
+regressed (gdouble cost,
+           gdouble baseline,
+           gdouble threshold)
+{
+  return cost > MAX (baseline, 1.0) * threshold;
+}
+
+static void
+result_print (const StressResult *result,
+              gboolean            first)
+{
+  GString *json = g_string_new (first ? "  " : ",\n  ");
+
+  g_string_append (json, "{\"file\":");
+  json_string (json, result->name);
+  g_string_append_printf (json,
+                          ",\"width\":%d,\"height\":%d"
+                          ",\"file_bytes\":%" G_GINT64_FORMAT
+                          ",\"pixel_bytes\":%" G_GUINT64_FORMAT
+                          ",\"loaded\":%s,\"seconds\":%.6f"
+                          ",\"memory_kb\":%" G_GUINT64_FORMAT
+                          ",\"allocations\":",
+                          result->extent.width, result->extent.height,
+                          result->file_bytes, result->pixel_bytes,
+                          result->pixel_bytes ? "true" : "false",
+                          result->time / (gdouble) G_USEC_PER_SEC,
+                          result->memory);
+  if (BENCH_COUNTS_ALLOCATIONS)
+    g_string_append_printf (json, "%" G_GUINT64_FORMAT, result->allocations);
+  else
+    g_string_append (json, "null");
+  g_string_append_printf (json, ",\"time_cost\":%.3f,\"memory_cost\":%.3f",
+                          result->time_cost, result->memory_cost);
+  if (result->in_baseline)
+    g_string_append_printf (json,
+                            ",\"baseline_time_cost\":%.3f"
+                            ",\"baseline_memory_cost\":%.3f",
+                            result->baseline_time_cost,
+                            result->baseline_memory_cost);
+  else
+    g_string_append (json,
+                     ",\"baseline_time_cost\":null"
+                     ",\"baseline_memory_cost\":null");
+  g_string_append_printf (json,
+                          ",\"out_of_proportion\":%s,\"regressed\":%s}",
+                          result->out_of_proportion ? "true" : "false",
+                          result->regressed ? "true" : "false");
+
+  fputs (json->str, stdout);
+  g_string_free (json, TRUE);
+}
+
+/* Checks, with -c.  Every input is decoded by libpng itself, expanded to
+ * 16 bit RGBA and nothing else, and every path through the ops has to
+ * give the same pixels, in the encoding and space of the file:
+ *
+ *   load     gegl:png-load, untrusted, which reads the file as a stream
+ *            and decodes it progressively
+ *   trusted  gegl:png-load, trusted, which maps the file and decodes its
+ *            gePB bands in parallel
+ *   roi      a box in the middle rendered uncached, decoding only the
+ *            rows down to it
+ *   batch    gegl:png-load-batch, over all of the inputs at once
+ *   save     gegl:png-save with several threads, which writes gePB
+ *            bands, read back by libpng and by a trusted gegl:png-load
+ *   stream   gegl:png-save-stream, read back by libpng
+ *   frames   every frame of an animated png saved again as an animation,
+ *            which picks dispose ops of its own, and loaded back
+ *   limits   a max-pixels of one less than the image fails the load, and
+ *            one of the image does not
+ *
+ * Inputs libpng can not decode are only loaded, which must not crash.
+ * Each input gets an object of the checks that ran and whether they
+ * passed, the failures also go to stderr, and the exit status is 1 if
+ * any check failed.
+ */
+#define STRESS_CHECK_MAX_PIXELS (1 << 24) /* larger inputs are not checked */
+#define STRESS_CHECK_THREADS    4
+
+typedef struct
+{
+  gint     width;
+  gint     height;
+  guint16 *pixels;   /* RGBA */
+} StressImage;
+
+/* decodes @path with libpng into @image, FALSE if it can not */
+static gboolean
+reference_decode (const gchar *path,
+                  StressImage *image)
+{
+  FILE                *file = g_fopen (path, "rb");
+  png_structp          png;
+  png_infop            info;
+  guchar     *volatile data = NULL;
+  png_bytep  *volatile rows = NULL;
+  gboolean             decoded = FALSE;
+  gsize                i;
+  gint                 y;
+
+  memset (image, 0, sizeof (StressImage));
+  if (! file)
+    return FALSE;
+
+  png  = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  info = png ? png_create_info_struct (png) : NULL;
+  if (! info)
+    {
+      png_destroy_read_struct (&png, NULL, NULL);
+      fclose (file);
+      return FALSE;
+    }
+
+  if (setjmp (png_jmpbuf (png)))
+    goto out;
+
+  png_init_io (png, file);
+  png_read_info (png, info);
+  image->width  = png_get_image_width (png, info);
+  image->height = png_get_image_height (png, info);
+  if ((guint64) image->width * image->height > STRESS_CHECK_MAX_PIXELS)
+    goto out;
+
+  png_set_expand (png);
+  png_set_expand_16 (png);
+  png_set_gray_to_rgb (png);
+  png_set_add_alpha (png, 0xffff, PNG_FILLER_AFTER);
+  png_set_interlace_handling (png);
+  png_read_update_info (png, info);
+
+  data = g_malloc ((gsize) image->width * image->height * 8);
+  rows = g_new (png_bytep, image->height);
+  for (y = 0; y < image->height; y++)
+    rows[y] = data + (gsize) y * image->width * 8;
+  png_read_image (png, rows);
+  decoded = TRUE;
+
+out:
+  png_destroy_read_struct (&png, &info, NULL);
+  fclose (file);
+  g_free (rows);
+
+  if (! decoded)
+    {
+      g_free (data);
+      memset (image, 0, sizeof (StressImage));
+      return FALSE;
+    }
+
+  image->pixels = (guint16 *) data;
+  for (i = 0; i < (gsize) image->width * image->height * 4; i++)
+    image->pixels[i] = GUINT16_FROM_BE (image->pixels[i]);
+
+  return TRUE;
+}
+
+/* the format the pixels of @buffer are compared in */
+static const Babl *
+check_format (GeglBuffer *buffer)
+{
+  return babl_format_with_space ("R'G'B'A u16",
+                                 gegl_buffer_get_format (buffer));
+}
+
+/* whether @pixels, @box of an image, are those of @image there */
+static gboolean
+check_pixels (const StressImage   *image,
+              const GeglRectangle *box,
+              const guint16       *pixels)
+{
+  gint x, y, c;
+
+  if (box->x < 0 || box->y < 0 ||
+      box->x + box->width > image->width ||
+      box->y + box->height > image->height)
+    return FALSE;
+
+  for (y = 0; y < box->height; y++)
+    {
+      const guint16 *row = image->pixels +
+                           ((gsize) (box->y + y) * image->width + box->x) * 4;
+
+      for (x = 0; x < box->width * 4; x += 4)
+        for (c = 0; c < 4; c++)
+          if (ABS ((gint) row[x + c] - (gint) pixels[x + c]) > 1)
+            return FALSE;
+      pixels += box->width * 4;
+    }
+
+  return TRUE;
+}
+
+/* whether @buffer holds @image */
+static gboolean
+check_buffer (const StressImage *image,
+              GeglBuffer        *buffer)
+{
+  const GeglRectangle *extent = gegl_buffer_get_extent (buffer);
+  guint16             *pixels;
+  gboolean             same;
+
+  if (extent->x || extent->y ||
+      extent->width != image->width || extent->height != image->height)
+    return FALSE;
+
+  pixels = g_new (guint16, (gsize) extent->width * extent->height * 4);
+  gegl_buffer_get (buffer, extent, 1.0, check_format (buffer), pixels,
+                   GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+  same = check_pixels (image, extent, pixels);
+  g_free (pixels);
+
+  return same;
+}
+
+/* whether @buffer holds the pixels of @other */
+static gboolean
+check_same (GeglBuffer *buffer,
+            GeglBuffer *other)
+{
+  const GeglRectangle *extent = gegl_buffer_get_extent (other);
+  StressImage          image;
+  gboolean             same;
+
+  image.width  = extent->width;
+  image.height = extent->height;
+  image.pixels = g_new (guint16, (gsize) extent->width * extent->height * 4);
+  gegl_buffer_get (other, extent, 1.0, check_format (buffer), image.pixels,
+                   GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+  same = ! extent->x && ! extent->y && check_buffer (&image, buffer);
+  g_free (image.pixels);
+
+  return same;
+}
+
+/* the image in @path, as gegl:png-load with @trusted and @max_pixels gives
+ * it, NULL if loading it failed
+ */
+static GeglBuffer *
+check_load (const gchar *path,
+            gboolean     trusted,
+            gint         max_pixels,
+            gint         frame)
+{
+  GeglNode   *graph    = gegl_node_new ();
+  GeglBuffer *buffer   = NULL;
+  gint        warnings = g_atomic_int_get (&n_warnings);
+  GeglNode   *load;
+  GeglNode   *sink;
+
+  load = gegl_node_new_child (graph,
+                              "operation",  "gegl:png-load",
+                              "path",       path,
+                              "trusted",    trusted,
+                              "max-pixels", max_pixels,
+                              "frame",      frame,
+                              NULL);
+  sink = gegl_node_new_child (graph,
+                              "operation", "gegl:buffer-sink",
+                              "buffer",    &buffer,
+                              NULL);
+  gegl_node_link (load, sink);
+  gegl_node_process (sink);
+  g_object_unref (graph);
+
+  if (g_atomic_int_get (&n_warnings) != warnings)
+    g_clear_object (&buffer);
+
+  return buffer;
+}
+
+/* renders @box of @path uncached, with the rows above it left undecoded */
+static gboolean
+check_roi (const StressImage *image,
+           const gchar       *path,
+           const Babl        *format)
+{
+  GeglNode      *graph    = gegl_node_new ();
+  gint           warnings = g_atomic_int_get (&n_warnings);
+  GeglRectangle  box;
+  GeglNode      *load;
+  guint16       *pixels;
+  gboolean       same;
+
+  gegl_rectangle_set (&box, image->width / 4, image->height / 3,
+                      MAX (image->width / 2, 1), MAX (image->height / 3, 1));
+  pixels = g_new (guint16, (gsize) box.width * box.height * 4);
+
+  load = gegl_node_new_child (graph,
+                              "operation", "gegl:png-load",
+                              "path",      path,
+                              NULL);
+  gegl_node_blit (load, 1.0, &box, format, pixels, GEGL_AUTO_ROWSTRIDE,
+                  GEGL_BLIT_DEFAULT);
+  g_object_unref (graph);
+
+  same = g_atomic_int_get (&n_warnings) == warnings &&
+         check_pixels (image, &box, pixels);
+  g_free (pixels);
+
+  return same;
+}
+
+/* saves @buffer, or the frames in @frames if it is NULL, to @target with
+ * @operation, FALSE on a warning
+ */
+static gboolean
+check_save (const gchar *operation,
+            GeglBuffer  *buffer,
+            GPtrArray   *frames,
+            const gchar *target)
+{
+  GeglNode *graph    = gegl_node_new ();
+  gint      warnings = g_atomic_int_get (&n_warnings);
+  GeglNode *source;
+  GeglNode *save;
+  guint     i;
+
+  g_unlink (target);
+  source = gegl_node_new_child (graph,
+                                "operation", "gegl:buffer-source",
+                                "buffer",    buffer ? buffer :
+                                             g_ptr_array_index (frames, 0),
+                                NULL);
+  save = gegl_node_new_child (graph,
+                              "operation", operation,
+                              "path",      target,
+                              "bitdepth",  16,
+                              NULL);
+  if (! buffer)
+    gegl_node_set (save,
+                   "frames", (gint) frames->len,
+                   NULL);
+  else if (! strcmp (operation, "gegl:png-save"))
+    gegl_node_set (save,
+                   "threads", STRESS_CHECK_THREADS,
+                   NULL);
+  gegl_node_link (source, save);
+
+  if (buffer)
+    gegl_node_process (save);
+  else
+    for (i = 0; i < frames->len; i++)
+      {
+        gegl_node_set (source,
+                       "buffer", g_ptr_array_index (frames, i),
+                       NULL);
+        gegl_node_process (save);
+      }
+  g_object_unref (graph);
+
+  return g_atomic_int_get (&n_warnings) == warnings;
+}
+
+/* saves @buffer with @operation and checks what libpng reads back, and
+ * with @reload what a trusted gegl:png-load does
+ */
+static gboolean
+check_round_trip (const gchar *operation,
+                  GeglBuffer  *buffer,
+                  const gchar *target,
+                  gboolean     reload)
+{
+  StressImage  saved = { 0, };
+  GeglBuffer  *back;
+  gboolean     same;
+
+  same = check_save (operation, buffer, NULL, target) &&
+         reference_decode (target, &saved) &&
+         check_buffer (&saved, buffer);
+  if (same && reload)
+    {
+      back = check_load (target, TRUE, 0, 0);
+      same = back && check_buffer (&saved, back);
+      g_clear_object (&back);
+    }
+  g_free (saved.pixels);
+
+  return same;
+}
+
+/* the number of frames of the animated png @path, 0 if it is not one */
+static guint32
+check_n_frames (const gchar *path)
+{
+  guchar  *data;
+  gsize    length;
+  GArray  *chunks;
+  guint32  n_frames = 0;
+  guint    i;
+
+  if (! g_file_get_contents (path, (gchar **) &data, &length, NULL))
+    return 0;
+
+  chunks = chunks_parse (data, length);
+  for (i = 0; chunks && i < chunks->len; i++)
+    {
+      const StressChunk *chunk = &g_array_index (chunks, StressChunk, i);
+
+      if (chunk_is (chunk, "acTL") && chunk->length == 8)
+        n_frames = (guint32) chunk->data[0] << 24 | chunk->data[1] << 16 |
+                   chunk->data[2] << 8 | chunk->data[3];
+    }
+  if (chunks)
+    g_array_free (chunks, TRUE);
+  g_free (data);
+
+  return n_frames;
+}
+
+/* loads every frame of @path, saves them again and loads those back */
+static gboolean
+check_frames (const gchar *path,
+              guint32      n_frames,
+              const gchar *target)
+{
+  GPtrArray *frames = g_ptr_array_new_with_free_func (g_object_unref);
+  gboolean   same   = TRUE;
+  guint      i;
+
+  for (i = 0; same && i < n_frames; i++)
+    {
+      GeglBuffer *frame = check_load (path, FALSE, 0, i);
+
+      if (frame)
+        g_ptr_array_add (frames, frame);
+      else
+        same = FALSE;
+    }
+
+  if (same)
+    same = check_save ("gegl:png-save", NULL, frames, target);
+
+  for (i = 0; same && i < n_frames; i++)
+    {
+      GeglBuffer *frame = check_load (target, FALSE, 0, i);
+
+      same = frame && check_same (frame, g_ptr_array_index (frames, i));
+      g_clear_object (&frame);
+    }
+  g_ptr_array_unref (frames);
+
+  return same;
+}
+
+/* appends check @check of an input to @json, and counts a failure */
+static void
+check_report (GString     *json,
+              const gchar *name,
+              const gchar *check,
+              gboolean     passed,
+              gint        *failures)
+{
+  if (json->str[json->len - 1] != '{')
+    g_string_append_c (json, ',');
+  g_string_append_printf (json, "\"%s\":%s", check,
+                          passed ? "true" : "false");
+
+  if (! passed)
+    {
+      g_printerr ("png-stress: %s failed the %s check\n", name, check);
+      (*failures)++;
+    }
+}
+
+/* loads the inputs libpng decodes with one gegl:png-load-batch node,
+ * into @buffers and @errors at the index @batched gives every input, -1
+ * for those left out
+ */
+static void
+check_batch (GPtrArray    *files,
+             gint         *batched,
+             GeglBuffer ***buffers,
+             GError     ***errors)
+{
+  GString  *paths = g_string_new (NULL);
+  GeglNode *graph;
+  GeglNode *batch;
+  gint      n = 0;
+  guint     f;
+
+  for (f = 0; f < files->len; f++)
+    {
+      const gchar *path = g_ptr_array_index (files, f);
+      StressImage  image;
+
+      batched[f] = -1;
+      if (! strchr (path, '\n') && reference_decode (path, &image))
+        {
+          g_string_append_printf (paths, "%s\n", path);
+          batched[f] = n++;
+          g_free (image.pixels);
+        }
+    }
+
+  *buffers = g_new0 (GeglBuffer *, MAX (n, 1));
+  *errors  = g_new0 (GError *, MAX (n, 1));
+  graph    = gegl_node_new ();
+  batch    = gegl_node_new_child (graph,
+                                  "operation", "gegl:png-load-batch",
+                                  "paths",     paths->str,
+                                  "buffers",   *buffers,
+                                  "errors",    *errors,
+                                  NULL);
+  /* the batch loads on the first query */
+  if (n)
+    gegl_node_get_bounding_box (batch);
+  g_object_unref (graph);
+  g_string_free (paths, TRUE);
+}
+
+/* runs the checks on @files, named @names, returning the failures */
+static gint
+check_inputs (GPtrArray *files,
+              GPtrArray *names)
+{
+  gint        *batched  = g_new (gint, files->len);
+  GeglBuffer **buffers;
+  GError     **errors;
+  gint         failures = 0;
+  gchar       *target;
+  gint         fd;
+  guint        f;
+
+  fd = g_file_open_tmp ("png-stress-XXXXXX.png", &target, NULL);
+  if (fd < 0)
+    {
+      g_printerr ("png-stress: could not create a temporary file\n");
+      return 1;
+    }
+  g_close (fd, NULL);
+
+  check_batch (files, batched, &buffers, &errors);
+
+  fputs ("[\n", stdout);
+  for (f = 0; f < files->len; f++)
+    {
+      const gchar *path = g_ptr_array_index (files, f);
+      const gchar *name = g_ptr_array_index (names, f);
+      GString     *json = g_string_new (f ? ",\n  " : "  ");
+      GeglBuffer  *loaded;
+      GeglBuffer  *trusted;
+      GeglBuffer  *limited;
+      StressImage  image;
+      guint32      n_frames;
+
+      g_string_append (json, "{\"file\":");
+      json_string (json, name);
+      g_string_append (json, ",\"checks\":{");
+
+      loaded  = check_load (path, FALSE, 0, 0);
+      trusted = check_load (path, TRUE, 0, 0);
+
+      if (reference_decode (path, &image))
+        {
+          gint     pixels = image.width * image.height;
+          gboolean passed;
+
+          check_report (json, name, "load",
+                        loaded && check_buffer (&image, loaded),
+                        &failures);
+          check_report (json, name, "trusted",
+                        trusted && check_buffer (&image, trusted),
+                        &failures);
+
+          if (batched[f] >= 0)
+            {
+              GeglBuffer *buffer = buffers[batched[f]];
+              GError     *error  = errors[batched[f]];
+
+              if (error)
+                g_printerr ("png-stress: %s: %s\n", name, error->message);
+              check_report (json, name, "batch",
+                            buffer && check_buffer (&image, buffer),
+                            &failures);
+            }
+
+          if (loaded)
+            {
+              check_report (json, name, "roi",
+                            check_roi (&image, path, check_format (loaded)),
+                            &failures);
+              check_report (json, name, "save",
+                            check_round_trip ("gegl:png-save", loaded,
+                                              target, TRUE),
+                            &failures);
+              check_report (json, name, "stream",
+                            check_round_trip ("gegl:png-save-stream", loaded,
+                                              target, FALSE),
+                            &failures);
+            }
+
+          /* the load meant to fail warns like any other */
+          if (pixels > 1)
+            {
+              limited = check_load (path, FALSE, pixels - 1, 0);
+              passed  = ! limited;
+              g_clear_object (&limited);
+
+              limited = check_load (path, FALSE, pixels, 0);
+              passed  = passed && limited;
+              g_clear_object (&limited);
+
+              check_report (json, name, "limits", passed, &failures);
+            }
+          g_free (image.pixels);
+        }
+
+      n_frames = check_n_frames (path);
+      if (n_frames > 1)
+        check_report (json, name, "frames",
+                      check_frames (path, n_frames, target), &failures);
+
+      g_clear_object (&loaded);
+      g_clear_object (&trusted);
+
+      g_string_append (json, "}}");
+      fputs (json->str, stdout);
+      g_string_free (json, TRUE);
+    }
+  fputs ("\n]\n", stdout);
+
+  g_printerr ("png-stress: %u inputs, %d checks failed\n", files->len,
+              failures);
+
+  for (f = 0; f < files->len; f++)
+    if (batched[f] >= 0)
+      {
+        g_clear_object (&buffers[batched[f]]);
+        g_clear_error (&errors[batched[f]]);
+      }
+  g_free (buffers);
+  g_free (errors);
+  g_free (batched);
+  g_unlink (target);
+  g_free (target);
+
+  return failures;
+}
+
+/* adds the pngs of the argument @arg to @files, in order, and their
+ * names to @names: the path below @arg, or @arg if it is a file
+ */
+static void
+collect_inputs (GPtrArray   *files,
+                GPtrArray   *names,
+                const gchar *arg)
+{
+  GPtrArray *found = g_ptr_array_new ();
+  gsize      length = strlen (arg);
+  guint      i;
+
+  collect_files (found, arg);
+  g_ptr_array_sort (found, compare_paths);
+
+  for (i = 0; i < found->len; i++)
+    {
+      gchar       *path = g_ptr_array_index (found, i);
+      const gchar *name = path;
+
+      if (strcmp (path, arg) && g_str_has_prefix (path, arg))
+        {
+          name = path + length;
+          while (G_IS_DIR_SEPARATOR (*name))
+            name++;
+        }
+
+      g_ptr_array_add (names, g_strdup (name));
+      g_ptr_array_add (files, path);
+    }
+  g_ptr_array_unref (found);
+}
+
+static void
+usage (void)
+{
+  g_printerr ("usage: png-stress [-r REPEATS] [-j THREADS] [-m MUTANTS] "
+              "[-d DICTIONARY]\n"
+              "                  [-x OUTLIER] [-t THRESHOLD] "
+              "[-b BASELINE | -w BASELINE] FILE|DIR...\n"
+              "       png-stress -c [-j THREADS] FILE|DIR...\n");
+  exit (2);
+}
+
+gint
+main (gint    argc,
+      gchar **argv)
+{
+  GPtrArray    *files      = g_ptr_array_new_with_free_func (g_free);
+  GPtrArray    *names      = g_ptr_array_new_with_free_func (g_free);
+  GByteArray   *mutant     = g_byte_array_new ();
+  GArray       *results    = g_array_new (FALSE, TRUE,
+                                          sizeof (StressResult));
+  GHashTable   *baseline   = NULL;
+  GPtrArray    *types;
+  const gchar  *dictionary = NULL;
+  const gchar  *baseline_path = NULL;
+  const gchar  *write_path = NULL;
+  gint          repeats    = 3;
+  gint          threads    = 0;
+  gint          n_mutants  = 0;
+  gdouble       outlier    = 8.0;
+  gdouble       threshold  = 2.0;
+  gboolean      check      = FALSE;
+  gint          failures   = 0;
+  gchar        *target;
+  gint          fd;
+  guint         f;
+  gint          i;
+
+  gegl_init (&argc, &argv);
+  g_log_set_default_handler (log_handler, NULL);
+
+  for (i = 1; i < argc; i++)
+    {
+      if (! strcmp (argv[i], "-r") && i + 1 < argc)
+        repeats = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "-j") && i + 1 < argc)
+        threads = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "-m") && i + 1 < argc)
+        n_mutants = atoi (argv[++i]);
+      else if (! strcmp (argv[i], "-d") && i + 1 < argc)
+        dictionary = argv[++i];
+      else if (! strcmp (argv[i], "-x") && i + 1 < argc)
+        outlier = g_ascii_strtod (argv[++i], NULL);
+      else if (! strcmp (argv[i], "-t") && i + 1 < argc)
+        threshold = g_ascii_strtod (argv[++i], NULL);
+      else if (! strcmp (argv[i], "-b") && i + 1 < argc)
+        baseline_path = argv[++i];
+      else if (! strcmp (argv[i], "-w") && i + 1 < argc)
+        write_path = argv[++i];
+      else if (! strcmp (argv[i], "-c"))
+        check = TRUE;
+      else if (argv[i][0] == '-')
+        usage ();
+      else
+        collect_inputs (files, names, argv[i]);
+    }
+  if (! files->len || repeats < 1 || n_mutants < 0 || outlier <= 0.0 ||
+      threshold <= 0.0 || (baseline_path && write_path) ||
+      (check && (baseline_path || write_path || n_mutants)))
+    usage ();
+
+  if (threads > 0)
+    g_object_set (gegl_config (), "threads", threads, NULL);
+
+  if (check)
+    {
+      failures = check_inputs (files, names);
+
+      g_array_free (results, TRUE);
+      g_byte_array_free (mutant, TRUE);
+      g_ptr_array_unref (files);
+      g_ptr_array_unref (names);
+      gegl_exit ();
+
+      return failures ? 1 : 0;
+    }
+
+  types = dictionary_load (dictionary);
+  if (baseline_path)
+    baseline = baseline_load (baseline_path);
+
+  fd = g_file_open_tmp ("png-stress-XXXXXX.png", &target, NULL);
+  if (fd < 0)
+    {
+      g_printerr ("png-stress: could not create a temporary file\n");
+      return 1;
+    }
+  g_close (fd, NULL);
+
+  for (f = 0; f < files->len; f++)
+    {
+      const gchar  *path = g_ptr_array_index (files, f);
+      const gchar  *name = g_ptr_array_index (names, f);
+      StressResult  result = { 0, };
+      guchar       *data;
+      gsize         length;
+
+      result.name = g_strdup (name);
+      stress_measure (path, repeats, &result);
+      g_array_append_val (results, result);
+
+      if (n_mutants && g_file_get_contents (path, (gchar **) &data, &length,
+                                            NULL))
+        {
+          for (i = 0; i < n_mutants; i++)
+            {
+              StressResult mutated = { 0, };
+
+              if (! mutate (data, length, name, i, types, mutant) ||
+                  ! g_file_set_contents (target, (const gchar *) mutant->data,
+                                         mutant->len, NULL))
+                break;
+
+              mutated.name = g_strdup_printf ("%s~%d", name, i);
+              stress_measure (target, repeats, &mutated);
+              g_array_append_val (results, mutated);
+            }
+          g_free (data);
+        }
+    }
+
+  results_normalize ((StressResult *) results->data, results->len);
+
+  fputs ("[\n", stdout);
+  for (f = 0; f < results->len; f++)
+    {
+      StressResult *result = &g_array_index (results, StressResult, f);
+      gdouble      *costs  = baseline ?
+                             g_hash_table_lookup (baseline, result->name) :
+                             NULL;
+
+      result->out_of_proportion = result->time_cost   > outlier ||
+                                  result->memory_cost > outlier;
+      if (costs)
+        {
+          result->in_baseline          = TRUE;
+          result->baseline_time_cost   = costs[0];
+          result->baseline_memory_cost = costs[1];
+          result->regressed =
+            regressed (result->time_cost, costs[0], threshold) ||
+            regressed (result->memory_cost, costs[1], threshold);
+        }
+      else if (baseline)
+        {
+          result->regressed = result->out_of_proportion;
+        }
+
+      if (result->regressed)
+        {
+          g_printerr ("png-stress: %s regressed, time %.2f memory %.2f "
+                      "times the median", result->name,
+                      result->time_cost, result->memory_cost);
+          if (costs)
+            g_printerr (", baseline %.2f and %.2f\n", costs[0], costs[1]);
+          else
+            g_printerr (", out of proportion and not in the baseline\n");
+          failures++;
+        }
+      else if (result->out_of_proportion)
+        {
+          g_printerr ("png-stress: %s is out of proportion, time %.2f "
+                      "memory %.2f times the median\n", result->name,
+                      result->time_cost, result->memory_cost);
+        }
+
+      result_print (result, f == 0);
+    }
+  fputs ("\n]\n", stdout);
+
+  if (write_path && ! baseline_write (write_path,
+                                      (StressResult *) results->data,
+                                      results->len))
+    {
+      g_printerr ("png-stress: could not write %s\n", write_path);
+      failures++;
+    }
+  else if (baseline)
+    {
+      g_printerr ("png-stress: %u inputs, %d regressed\n", results->len,
+                  failures);
+    }
+
+  for (f = 0; f < results->len; f++)
+    g_free (g_array_index (results, StressResult, f).name);
+  g_array_free (results, TRUE);
+  if (baseline)
+    g_hash_table_unref (baseline);
+  g_ptr_array_unref (types);
+  g_byte_array_free (mutant, TRUE);
+  g_unlink (target);
+  g_free (target);
+  g_ptr_array_unref (files);
+  g_ptr_array_unref (names);
+  gegl_exit ();
+
+  return failures ? 1 : 0;
+}